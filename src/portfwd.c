@@ -9,6 +9,9 @@
  * Solaris: gcc -o portfwd portfwd.c -lxnet
  *   Win32: cl portfwd.c wsock32.lib (assumes MSVC)
  *
+ * For compressed tunnels add -DHAVE_LZ4 -llz4 and/or -DHAVE_ZSTD -lzstd
+ * On x86, -mavx2 lets -route sniff protocols with AVX2 rather than SSE2
+ *
  * $Id: portfwd.c,v 1.6 2004/10/09 09:08:18 emikulic Exp $
  *
  * ---------- >
@@ -26,6 +29,37 @@
  * 2002-12-28 - fixed rare segfault (thanks to PsychoAnt for spotting
  *              it and providing debug help) and improved efficiency
  * 2003-02-19 - code cleanup
+ * 2026-10-17 - option parsing loop, MSG_ZEROCOPY for large sends
+ * 2026-10-17 - TCP Fast Open, TCP_DEFER_ACCEPT
+ * 2026-10-17 - source address pools and port ranges for outgoing
+ *              connections, stats on SIGUSR1
+ * 2026-10-17 - overload policies: reset, queue with deadline, shed
+ * 2026-10-17 - survive running out of file descriptors
+ * 2026-10-17 - per-connection byte budgets, round-robin service order,
+ *              client weights
+ * 2026-10-17 - non-blocking sockets drained until EAGAIN, epoll on Linux
+ * 2026-10-17 - pooled buffers in size classes picked from traffic history
+ * 2026-10-17 - buffers carved from one hugepage-backed arena
+ * 2026-10-17 - buffers attached only while data is in flight
+ * 2026-10-17 - optional in-kernel forwarding through a BPF sockmap
+ * 2026-10-17 - tunnel mode: clients multiplexed over persistent links
+ *              to a second portfwd
+ * 2026-10-17 - LZ4/zstd compression of tunnel streams
+ * 2026-10-17 - tunnel streams striped over all links
+ * 2026-10-17 - reverse mode: pools of connections opened by the server
+ *              side
+ * 2026-10-17 - routing by TLS server name or HTTP Host
+ * 2026-10-17 - routing by protocol, vectorized sniffing
+ * 2026-10-17 - PROXY protocol v2 header for the server
+ * 2026-10-17 - client allow and deny lists, reloaded on SIGHUP
+ * 2026-10-17 - access lists compiled into a socket filter on Linux
+ * 2026-10-17 - per-client byte counts kept in a file, quotas
+ * 2026-10-17 - backlogs spilled to files for stalled receivers
+ * 2026-10-17 - small reads coalesced into fewer sends
+ * 2026-10-17 - interactive connections told from bulk ones, served
+ *              first and marked
+ * 2026-10-17 - worker processes sharing the port, connections handed
+ *              from busy workers to idle ones
  */
 
 #include <sys/types.h>
@@ -35,6 +69,8 @@
 # include <winsock2.h>
 # define vsnprintf _vsnprintf
 # define MSG_DONTWAIT 0
+# define strcasecmp _stricmp
+# define strncasecmp _strnicmp
 # define socklen_t int
 # undef IN
 # undef OUT
@@ -43,6 +79,11 @@
 # include <arpa/inet.h>
 # include <sys/time.h>
 # include <sys/socket.h>
+# include <netinet/tcp.h>
+# include <sys/ioctl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <strings.h>
 # include <unistd.h>
 # define INVALID_SOCKET -1
 # define SOCKET int
@@ -51,14 +92,94 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+# include <linux/errqueue.h>
+# include <linux/sockios.h>
+# include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_bpf) && defined(SO_COOKIE) && \
+	!defined(NO_SOCKMAP)
+# include <linux/bpf.h>
+# define HAVE_SOCKMAP
+#endif
+
+#if defined(__linux__) && defined(SO_ATTACH_FILTER) && !defined(NO_ACL_FILTER)
+# include <linux/filter.h>
+# define HAVE_ACL_FILTER
+#endif
+
+#if defined(__linux__) && !defined(NO_SPILL)
+# include <sys/sendfile.h>
+# define HAVE_SPILL
+#endif
+
+#if defined(SO_REUSEPORT) && defined(SCM_RIGHTS) && !defined(_WIN32) && \
+	!defined(NO_WORKERS)
+# include <sys/wait.h>
+# define HAVE_WORKERS
+#endif
+
+#if defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+# define HAVE_ZEROCOPY
+#endif
+
+#ifdef HAVE_LZ4
+# include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+#if defined(__GNUC__) && defined(__AVX2__)
+# include <immintrin.h>
+# define HAVE_AVX2
+#elif defined(__GNUC__) && defined(__SSE2__)
+# include <emmintrin.h>
+# define HAVE_SSE2
+#endif
+
+#if defined(__linux__) && !defined(NO_EPOLL)
+# include <sys/epoll.h>
+# define USE_EPOLL
+# define MAX_EVENTS 256
+# if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 35)
+#  define HAVE_EPOLL_PWAIT2
+# endif
+#endif
 
 #define BACKLOG_SIZE 65530
 
+/* Buffer size classes.  Each direction of a connection receives into a
+ * buffer from the smallest class that fits about twice its recent read
+ * size, so chatty connections don't each pin 64K.  The last class is
+ * only for tunnel streams, which must be able to hold a whole window.
+ */
+#define STREAM_WINDOW (1 << 20)
+#define NUM_CLASSES 4
+#define READ_CLASSES 3
+static const int class_size[NUM_CLASSES] = { 2048, 16384, BACKLOG_SIZE,
+	STREAM_WINDOW };
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define MAX_DEFAULT_ARENA ((size_t)1 << 30)
+#define DEFAULT_BUDGET (16 * BACKLOG_SIZE)
+#define MAX_BUDGET (1 << 30)
+#define ACCEPT_BURST 16
+#define DRAIN_POLL_MS 10
+#define DRAIN_TIMEOUT 10000
+#define MAX_LINKS 64
+#define LINK_RETRY_MS 1000
+#define MAX_SLOTS (1 << 24)
+
 #ifndef max
 #define max(a,b) ((a)>(b)?(a):(b))
 #endif
@@ -69,6 +190,292 @@
  */
 typedef enum {IN, OUT} direction;
 
+/*
+ * What we know about a connection's sockets.  A bit is set when the
+ * socket is reported ready, and cleared once it runs dry (EAGAIN) or
+ * fills up, so readiness can be edge-triggered.
+ */
+#define RD_IN	1
+#define WR_IN	2
+#define RD_OUT	4
+#define WR_OUT	8
+
+/* The client (EOF_IN) or server (EOF_OUT) has closed, but what it sent
+ * is still on its way, so the connection closes once that's gone. */
+#define EOF_IN	16
+#define EOF_OUT	32
+
+/* The server side's connect() is still under way. */
+#define CONNECTING 64
+
+/*
+ * Where a connection stands with the sockmap.
+ * USERSPACE: bounce() moves its data (the traditional way)
+ * KERNEL: the kernel redirects between the two sockets by itself
+ * DRAINING: one side hit EOF, waiting for the other to send what the
+ *           kernel redirected before closing it
+ * PINNED: couldn't be put in the sockmap, stays in userspace
+ */
+#define SOCKMAP_USERSPACE	0
+#define SOCKMAP_KERNEL		1
+#define SOCKMAP_DRAINING	2
+#define SOCKMAP_PINNED		3
+
+/*
+ * Tunnel mode, for two portfwds across a long link.
+ * NONE: each client gets its own connection to the server
+ * CLIENT: clients are carried as streams over a few persistent links
+ *         to a portfwd in SERVER mode (-tunnel)
+ * SERVER: accepts links, and connects to the server for each stream
+ *         (-untunnel)
+ *
+ * A slot holding a stream has TUNNEL_SOCKET in place of the socket on
+ * the link side.  Everything on a link is framed:
+ *   4 bytes stream id, 1 byte type, 1 byte zero, 2 bytes length
+ * followed by length bytes of payload.  The id is the client side's
+ * slot in the low 24 bits and a generation count in the top 8, so
+ * frames still in flight for a closed stream can't reach its
+ * successor.  Each side may send at most STREAM_WINDOW bytes of DATA
+ * per stream ahead of the WINDOW frames that hand back credit as the
+ * other side passes the data on.
+ */
+typedef enum {TUNNEL_NONE, TUNNEL_CLIENT, TUNNEL_SERVER} tunnel_mode;
+
+#define TUNNEL_SOCKET ((SOCKET)-2)
+#define FRAME_HDR 8
+#define FRAME_OPEN 1
+#define FRAME_DATA 2
+#define FRAME_CLOSE 3
+#define FRAME_WINDOW 4
+#define FRAME_HELLO 5
+#define FRAME_PACKED 6
+#define FRAME_SDATA 7
+#define FRAME_SPACKED 8
+#define FRAME_MAX (4 + BACKLOG_SIZE)	/* sequence number, a full buffer */
+#define LINK_BUF_SIZE (4 * (FRAME_HDR + FRAME_MAX))
+
+/*
+ * Streams can be compressed (-compress).  When a link comes up the
+ * server side sends a HELLO listing the codecs it was built with, as a
+ * bitmask of 1 << codec, and the client names one of them in the OPEN
+ * of each stream.  From then on either side may send that stream's
+ * DATA as a PACKED frame instead.  Every frame is compressed on its
+ * own, and windows count uncompressed bytes.
+ */
+#define CODEC_NONE 0
+#define CODEC_LZ4 1
+#define CODEC_ZSTD 2
+#define PACK_MIN 512		/* not worth compressing smaller sends */
+#define PACK_BACKOFF 6		/* skip up to 2^6 sends after misses */
+#define ZSTD_LEVEL 3
+
+/*
+ * Streams can also be striped over every link to the same peer
+ * (-stripe), so one client isn't held to what a single TCP connection
+ * can carry.  The client sets STREAM_STRIPED in the second byte of the
+ * OPEN, and both sides then send its data as SDATA or SPACKED frames,
+ * whose payload starts with a 4 byte sequence number.  Frames that
+ * overtake others on a faster link are held until their turn, within
+ * the stream's window.  Until the first frame comes back for a stream
+ * the client keeps to its own link, so nothing can overtake the OPEN,
+ * and a CLOSE carries the number of frames sent before it.  The client
+ * says who it is in its HELLO so the server can tell which links
+ * belong together.
+ */
+#define STREAM_STRIPED	1
+#define STREAM_ACKED	2	/* the far side has seen the OPEN */
+#define STREAM_ENDING	4	/* CLOSEd, waiting for frames in flight */
+
+/*
+ * Reverse mode, for servers that can only connect out.
+ * NONE: we connect to the server for each client
+ * PUBLIC: portfwds next to the server keep idle connections open to
+ *         us, and each client is spliced onto one of them (-pool)
+ * BACKEND: keep idle connections open to a PUBLIC portfwd, and connect
+ *          one to the server when a client claims it (-reverse)
+ *
+ * A pooled connection is claimed with a POOL_MARKER byte ahead of the
+ * client's data, so the server gets connected straight away even if
+ * it's the one to speak first, and never just for being in the pool.
+ */
+typedef enum {REVERSE_NONE, REVERSE_PUBLIC, REVERSE_BACKEND} reverse_mode;
+
+#define POOL_MARKER 1
+
+/* -proxyv2: the server is told who the client is by a PROXY protocol
+ * version 2 header ahead of its data, which for IPv4 is this long */
+#define PROXY_HDR_MAX 28
+
+/*
+ * Routing (-route).  A new client is held without a slot, but counted
+ * against the limit, until its first bytes can be peeked at.  They're
+ * matched against the signatures of a few protocols, and a route can
+ * take every client of one (@ssh), or only those whose key names it:
+ * the server name in a TLS ClientHello, the Host header of an HTTP
+ * request, or the database in a PostgreSQL startup message.  Anything
+ * else goes to the default remote.  So do clients that say nothing for
+ * ROUTE_WAIT_MS, like those of protocols where the server speaks
+ * first.  Nothing is read, so the server still gets the whole stream.
+ */
+#define ROUTE_WAIT_MS 1000
+#define PEEK_SIZE 4096
+#define PEEK_PAD 32		/* vector loads may run this far past */
+#define PROTO_NONE	0
+#define PROTO_TLS	1
+#define PROTO_HTTP	2
+#define PROTO_HTTP2	3	/* the prior knowledge preface */
+#define PROTO_SSH	4
+#define PROTO_REDIS	5
+#define PROTO_POSTGRES	6
+#define NUM_PROTOS	7
+static const char *proto_names[NUM_PROTOS] = { "other", "tls", "http",
+	"h2", "ssh", "redis", "postgres" };
+
+/* Up to 16 first bytes, with zero mask bytes matching anything.  The
+ * first signature the client matches in full says what it speaks. */
+static const struct signature {
+	const char *bytes, *mask;
+	int len, proto;
+} signatures[] = {
+	{ "\x16\x03\0\0\0\x01", "\xff\xff\0\0\0\xff", 6, PROTO_TLS },
+	{ "PRI * HTTP/2.0\r\n", NULL, 16, PROTO_HTTP2 },
+	{ "GET ", NULL, 4, PROTO_HTTP },
+	{ "POST ", NULL, 5, PROTO_HTTP },
+	{ "HEAD ", NULL, 5, PROTO_HTTP },
+	{ "PUT ", NULL, 4, PROTO_HTTP },
+	{ "DELETE ", NULL, 7, PROTO_HTTP },
+	{ "OPTIONS ", NULL, 8, PROTO_HTTP },
+	{ "PATCH ", NULL, 6, PROTO_HTTP },
+	{ "CONNECT ", NULL, 8, PROTO_HTTP },
+	{ "SSH-2.0-", NULL, 8, PROTO_SSH },
+	{ "*0", "\xff\xf0", 2, PROTO_REDIS },	/* an array of commands */
+	{ "\0\0\0\0\0\x03\0\0", "\xff\xff\0\0\xff\xff\xff\xff", 8,
+		PROTO_POSTGRES },	/* startup, protocol 3.0 */
+	{ "\0\0\0\x08\x04\xd2\x16\x2f", NULL, 8, PROTO_POSTGRES },
+	{ "\0\0\0\x08\x04\xd2\x16\x30", NULL, 8, PROTO_POSTGRES }
+};
+#define NUM_SIGNATURES ((int)(sizeof(signatures) / sizeof(signatures[0])))
+
+/* The signatures again, padded to 16 bytes and with the bytes masked,
+ * so one compare tests one (or with AVX2, two) of them */
+static unsigned char sig_bytes[NUM_SIGNATURES + 1][16],
+		     sig_mask[NUM_SIGNATURES + 1][16];
+#define SNIFF_READY	1
+#define SNIFF_PARTIAL	2	/* peeked, but not enough to go on */
+
+/*
+ * Client access lists (-allow, -deny).  The files' prefixes are built
+ * into a multibit trie whose nodes each take the next ACL_STRIDE bits
+ * of the address, with one bitmap of the slots that lead on to a child
+ * and one of those that are denied.  A node's children are kept
+ * together, so counting the child bits below a slot finds its child,
+ * as in a poptrie, and a lookup reads at most six 24 byte nodes.  The
+ * longest matching prefix decides, and a client matching none is let
+ * in unless there are allow lists.  SIGHUP rebuilds the trie from the
+ * files and swaps it in.
+ */
+#define ACL_STRIDE 6
+
+/*
+ * Per-client usage (-usage).  Clients are grouped by the first
+ * usage_bits bits of their address, and each group's bytes in both
+ * directions are kept in an open addressed hash table that lives in an
+ * mmap'd file, so it survives restarts and can be read by anything
+ * that knows the layout below.  bounce() counts into the connection's
+ * slot, and that is added to the table every USAGE_FOLD bytes and at
+ * close.  A group that has moved -quota bytes in all has its
+ * connections closed, or with -quota-rate, throttled to that many
+ * bytes a second between them.  An entry is in use while USAGE_USED
+ * is set in its flags; something outside may retire one by setting
+ * USAGE_GONE in its place, and the entry is then reused for the next
+ * new group whose probe passes it.
+ */
+#define USAGE_MAGIC "portfwdU"
+#define USAGE_VERSION 1
+#define USAGE_USED 1		/* entry flags */
+#define USAGE_GONE 2		/* retired: free, but probes go on past */
+#define USAGE_ENTRIES (1 << 16)	/* for a new file, a power of two */
+#define USAGE_FOLD 65536
+#define USAGE_TOP 5		/* groups listed on SIGUSR1 */
+#define QUOTA_TICK_MS 20
+
+/*
+ * Spilling (-spill).  Normally a receiver that stops reading stops the
+ * sender too: nothing more is read while a backlog is waiting.  With a
+ * spill directory, what the sender keeps sending goes on the end of an
+ * unlinked file instead, once the receiver's socket buffer and the
+ * backlog are full.  The socket buffers are set to SPILL_MEM (or
+ * -spill-mem), above what the kernel would grow them to, so ordinary
+ * flow control doesn't spill.  The file is sent on with
+ * sendfile() after the backlog, and closed when it's all gone, so a
+ * connection holds at most one buffer of memory however long the
+ * receiver stalls.  If the sender closes, the connection is only closed
+ * once the receiver has everything.
+ */
+#define SPILL_MEM	(4 << 20)
+#define SPILL_FAILED	1	/* << dir: couldn't make a file */
+
+/*
+ * Coalescing (-coalesce).  A chatty peer that writes a few bytes at a
+ * time costs a send() per recv().  With a coalescing threshold, what
+ * bounce() reads is held in the buffer until there's that much of it,
+ * the buffer is full, or the oldest of it has waited the deadline (in
+ * microseconds), and then goes out in one send().
+ */
+#define WAIT_MAX_MS 1000000L	/* longest wait, so it fits in us */
+
+/*
+ * Traffic classes (-classify).  With "auto", connections start out
+ * interactive, and every WINDOW_MS those that had data moving in at
+ * least BULK_DUTY percent of the milliseconds, in reads of BULK_READ or
+ * more, or that moved BULK_BYTES whatever the duty, become bulk.  They
+ * go back once they're under half of each.  Interactive connections are
+ * serviced first on every pass, and bulk ones get a BULK_SHARE of the
+ * byte budget so that passes stay short.  Both sockets of a connection
+ * are marked for its class with IP_TOS (or -dscp) and SO_PRIORITY.
+ */
+#define WINDOW_MS 250
+#define BULK_DUTY 50
+#define BULK_READ 1024
+#define BULK_BYTES (1 << 20)
+#define BULK_SHARE 4		/* of the byte budget, per pass */
+#define TRAFFIC_INTERACTIVE 0
+#define TRAFFIC_BULK 1
+#define TOS_INTERACTIVE 0x10	/* IPTOS_LOWDELAY */
+#define TOS_BULK 0x08		/* IPTOS_THROUGHPUT */
+#define PRIO_INTERACTIVE 6	/* TC_PRIO_INTERACTIVE */
+#define PRIO_BULK 2		/* TC_PRIO_BULK */
+typedef enum {CLASSIFY_NONE, CLASSIFY_AUTO, CLASSIFY_INTERACTIVE,
+	CLASSIFY_BULK} classify_mode;
+
+/*
+ * Workers (-workers).  The forwarder forks that many processes, each
+ * with its own listener on the port (SO_REUSEPORT), and the parent just
+ * waits on them and passes signals on.  The kernel spreads clients by
+ * hash, so a few heavy ones can land on the same worker.  At the end of
+ * each window, every worker posts how many bytes a second it moved in a
+ * shared table, and one moving more than REBALANCE_RATIO times the mean
+ * hands a connection to the least busy worker with room: the biggest
+ * one that narrows the gap.  Only connections with nothing held in
+ * userspace are handed over, as their two sockets plus a little state,
+ * in a datagram with SCM_RIGHTS on the other worker's socket.  The
+ * kernel queues them, so no worker ever waits on another.
+ */
+#define REBALANCE_RATIO 1.5
+#define REBALANCE_MIN (1 << 20)		/* bytes a second, to bother */
+#define REBALANCE_WAIT 4		/* windows, after handing one over */
+#define MAX_WORKERS 64
+
+/*
+ * What to do with new clients when all slots are taken.
+ * WAIT: leave them in the kernel's accept queue (the traditional way)
+ * RESET: accept and reset them straight away
+ * QUEUE: accept and hold them for a slot until a deadline
+ * SHED: make room by closing the longest idle connection
+ */
+typedef enum {OVERLOAD_WAIT, OVERLOAD_RESET, OVERLOAD_QUEUE,
+	OVERLOAD_SHED} overload_policy;
+
 /* Globals */
 static SOCKET	*conn_in = NULL,
 		*conn_out = NULL,
@@ -80,14 +487,322 @@ static int	 max_connections = 10,
 		*backlog_out_size = NULL,
 		*backlog_in_pos = NULL,
 		*backlog_out_pos = NULL,
+		*read_in_avg = NULL,
+		*read_out_avg = NULL,
+		*zc_in_pending = NULL,
+		*zc_out_pending = NULL,
+		 use_fionread = 0,
+		 arena_mb = -1,
+		 lock_arena = 0,
+		 arena_huge = 0,
+		 page_buffers = 0,
+		 buffers_in_use = 0,
+		 zerocopy_min = 0,
+		 fastopen_qlen = 0,
+		 defer_accept = 0,
 		 verbose = 0,
 		 localport,
-		 remoteport;
+		 remoteport,
+		 srcport_lo = 0,
+		 srcport_hi = 0,
+		 srcport_next = 0,
+		 num_srcaddrs = 0,
+		 next_srcaddr = 0,
+		 queue_deadline = 0,
+		 queue_head = 0,
+		 num_queued = 0,
+		 spare_fd = -1,
+		 byte_budget = DEFAULT_BUDGET,
+		*conn_budget = NULL,
+		 work_left = 0,
+		 sockin_ready = 0,
+		 rr_start = 0,
+		 num_weights = 0,
+		 use_sockmap = 0,
+		 num_draining = 0,
+		 num_links = 0,
+		 hash_bits = 0,
+		*stream_link = NULL,
+		*stream_credit = NULL,
+		*stream_owed = NULL,
+		*stream_hash = NULL,
+		*stream_held = NULL,
+		 compress_codec = CODEC_NONE,
+		 use_stripes = 0,
+		*queued_route = NULL,
+		 num_routes = 0,
+		 num_sniffing = 0,
+		 proxy_protocol = 0;
+
+#ifdef USE_EPOLL
+static int	 epfd = -1,
+		 sockin_watched = 0,
+		 poolin_watched = 0;
+
+/* epoll data for sockin; connections use slot*2 + (0 for IN, 1 for OUT),
+ * links LINK_FLAG + link, pooled connections POOL_FLAG + pool entry, and
+ * clients waiting to be routed SNIFF_FLAG + their place in sniffing */
+#define SOCKIN_ID 0xFFFFFFFFU
+#define POOLIN_ID 0xFFFFFFFEU
+#define LINK_FLAG 0x80000000U
+#define POOL_FLAG 0x40000000U
+#define SNIFF_FLAG 0x20000000U
+#define HANDOFF_ID 0xFFFFFFFDU
+#endif
+
+static overload_policy overload = OVERLOAD_WAIT;
+static tunnel_mode tunnel = TUNNEL_NONE;
+static reverse_mode reverse = REVERSE_NONE;
+static classify_mode classify = CLASSIFY_NONE;
+
+/* idle pooled connections, and where a BACKEND opens them */
+static SOCKET	*pool = NULL,
+		 poolin = INVALID_SOCKET;
+static unsigned char *pool_ready = NULL;
+static int	 pool_count = 0,
+		 pool_size = 0,
+		 pool_port = 0,
+		 poolin_ready = 0;
+static struct sockaddr_in pool_addr;
+static unsigned long pool_retry = 0;
+
+/* milliseconds, refreshed once per poll_conn() */
+static unsigned long	 now = 0,
+			*last_active = NULL,
+			*queued_since = NULL,
+			*sniff_since = NULL,
+			 sniff_wake = 0,
+			 accept_backoff = 0,
+			 accept_resume = 0;
+
+static SOCKET	*queued = NULL,
+		*sniffing = NULL;
+
+static unsigned int	*stream_id = NULL,
+			*stream_tx_seq = NULL,
+			*stream_rx_seq = NULL,
+			*stream_end = NULL,
+			 peer_tag = 0;
+
+/* a striped frame that arrived ahead of its turn */
+static struct held {
+	struct held *next;
+	unsigned int seq;
+	int packed, len;
+	char data[1];
+} **held_frames = NULL;
+
+/* links between tunnelling portfwds */
+static struct link {
+	SOCKET s;
+	char *rbuf, *wbuf;	/* partial frame in, frames waiting to go out */
+	int rlen, wpos, wlen, wcap;
+	int readable, writable, failed, streams;
+	int starved;		/* streams are waiting for room */
+	int connecting;		/* connect() is under way */
+	int codecs;		/* what the far side can unpack */
+	int inflight;		/* unacked in the kernel at the last flush */
+	unsigned int peer;	/* the client portfwd it comes from */
+	unsigned long down_since;
+} *links = NULL;
+
+#ifdef HAVE_ZSTD
+static ZSTD_CCtx *zstd_c = NULL;
+static ZSTD_DCtx *zstd_d = NULL;
+#endif
+
+/* Per-slot state that isn't needed per byte is kept small, since most
+ * slots of a big forwarder hold idle connections */
+static unsigned char	*conn_ready = NULL,
+			*sockmap_state = NULL,
+			*backlog_in_class = NULL,
+			*backlog_out_class = NULL,
+			*stream_codec = NULL,
+			*stream_flags = NULL,
+			*pack_skip = NULL,
+			*pack_misses = NULL,
+			*sniff_flags = NULL,
+			*over_quota = NULL,
+			*spill_flags = NULL,
+			*is_ready = NULL;
+
+/* The slots in use come first in slot_list, in no order, then the free
+ * ones; slot_pos is where each slot is in it.  Slots from slots_seen up
+ * have never been used, and are in their own place without it being
+ * written down, so their pages are never touched.  ready_list holds the
+ * slots to service on the next pass, each once, so a pass costs nothing
+ * for connections that have nothing to do.  is_ready says which list a
+ * slot is on, if any. */
+#define READY_NEXT 1
+#define READY_NOW 2
+static int	*slot_list = NULL,
+		*slot_pos = NULL,
+		 slots_used = 0,
+		 slots_seen = 0,
+		*ready_list = NULL,
+		*ready_next = NULL,
+		 num_ready = 0;
 
 static char	**backlog_in = NULL,
 		**backlog_out = NULL,
+		 *free_buffers[NUM_CLASSES],
+		 *pack_buf = NULL,
 		 *remotehost;
 
+static struct in_addr *srcaddrs = NULL;
+
+/* All buffers are carved from here while it lasts */
+static char	*arena = NULL;
+static size_t	 arena_size = 0,
+		 arena_used = 0;
+
+/* -weight classes: clients in net/mask get weight times the budget */
+static struct weight_class {
+	unsigned long net, mask;
+	int weight;
+} *weights = NULL;
+
+/* -route: clients asking for name go to addr; "*." names match any
+ * subdomain, and "@" names any client speaking that protocol */
+static struct route {
+	const char *name;
+	int proto;		/* or PROTO_NONE to go by name */
+	struct sockaddr_in addr;
+} *routes = NULL;
+
+/* where the access lists come from, and the trie built from them */
+static struct acl_source {
+	const char *path;
+	int deny;
+} *acl_sources = NULL;
+static int num_acl_sources = 0;
+
+static struct acl_node {
+	unsigned long long children, denied;	/* bit per slot */
+	unsigned int base;			/* first child */
+} *acl = NULL;
+
+/* the -usage file: a header, then the table */
+static struct usage_header {
+	char magic[8];
+	unsigned long long since;	/* time(), when it was made */
+	unsigned int entries, bits;
+	unsigned int used;		/* taken, in use or retired */
+	unsigned int version;
+} *usage_hdr = NULL;
+static struct usage_entry {
+	unsigned int net;		/* host order */
+	unsigned int flags;		/* 0 if never used */
+	unsigned int connections, pad;
+	unsigned long long from_client, to_client;
+} *usage = NULL;
+static const char *usage_path = NULL;
+static int usage_bits = 32,
+	   usage_shift = 0,
+	  *conn_client = NULL,		/* slot's entry, or -1 */
+	   quota_wake = 0;
+static unsigned long	*unfolded_in = NULL,
+			*unfolded_out = NULL,
+			*usage_refilled = NULL;
+static long		*usage_tokens = NULL,
+			 quota_rate = 0;
+static unsigned long long quota = 0;
+
+/* -spill: the file each direction's backlog overflows into, how much
+ * has been written to it, and how much of that sent on */
+#ifdef HAVE_SPILL
+static int	*spill_in_fd = NULL,
+		*spill_out_fd = NULL,
+		 spill_mem = 0;
+static off_t	*spill_in_end = NULL,
+		*spill_out_end = NULL,
+		*spill_in_pos = NULL,
+		*spill_out_pos = NULL,
+		 spill_max = 0;
+static char	*spill_buf = NULL;
+#endif
+static const char *spill_dir = NULL;
+static int num_spilling = 0;
+
+/* -coalesce: how much is held back for each direction and since when
+ * (in microseconds); how many were holding on the last pass, and the
+ * earliest of their deadlines */
+static int	 coalesce_min = 0,
+		*corked_in = NULL,
+		*corked_out = NULL,
+		 num_corked = 0;
+static long	 coalesce_us = 0;
+static unsigned long	 now_us = 0,
+			*corked_in_since = NULL,
+			*corked_out_since = NULL,
+			 cork_wake = 0;
+
+/* -classify: each connection's class, and what it did this window */
+static unsigned char	*traffic_class = NULL;
+static unsigned short	*busy_ms = NULL;
+static unsigned long	*busy_tick = NULL,
+			*window_bytes = NULL,
+			 window_start = 0;
+static int dscp = -1;
+
+/* -workers: which one this is, what each one reports, and where to send
+ * connections for each */
+static int num_workers = 1,
+	   worker = 0;
+#ifdef HAVE_WORKERS
+static struct worker_load {
+	volatile unsigned long rate;	/* bytes a second, last window */
+	volatile int room;		/* free slots */
+} *loads = NULL;
+static SOCKET	 handoff_in = INVALID_SOCKET,
+		*handoff_out = NULL;
+static pid_t	*worker_pids = NULL;
+static int	 handoff_ready = 0,
+		 rebalance_wait = 0;
+
+/* a connection on its way to another worker; its sockets go alongside */
+struct handoff {
+	int from;
+	int read_in_avg, read_out_avg;
+	unsigned char traffic_class, returned;
+};
+#endif
+
+static volatile sig_atomic_t want_stats = 0,
+			     want_reload = 0;
+
+/* Counters, dumped on SIGUSR1 */
+static unsigned long	stat_accepted = 0,
+			stat_connect_failed = 0,
+			stat_ports_exhausted = 0,
+			stat_overload_reset = 0,
+			stat_overload_queued = 0,
+			stat_queue_expired = 0,
+			stat_overload_shed = 0,
+			stat_fd_exhausted = 0,
+			stat_offloaded = 0,
+			stat_offload_failed = 0,
+			stat_kernel_bytes = 0,
+			stat_streams = 0,
+			stat_reordered = 0,
+			stat_pool_claimed = 0,
+			stat_pool_died = 0,
+			stat_routed = 0,
+			stat_route_default = 0,
+			stat_protos[NUM_PROTOS],
+			stat_denied = 0,
+			stat_usage_full = 0,
+			stat_over_quota = 0,
+			stat_spilled = 0,
+			stat_spill_failed = 0,
+			stat_coalesced = 0,
+			stat_reclassified = 0,
+			stat_handed_off = 0,
+			stat_taken_over = 0,
+			stat_pack_in = 0,
+			stat_pack_out = 0,
+			stat_pack_skipped = 0;
+
 
 
 /* Handling fatal errors */
@@ -129,188 +844,3807 @@ static void init_winsock(void)
 
 
 
-/* TODO - make outgoing connection before accepting incoming one */
-static void accept_incoming(void)
+static unsigned long get_time_ms(void)
 {
-	struct sockaddr_in addrin, addrout;
-	socklen_t sin_size;
-	int i, curr=-1;
-	SOCKET incoming, outgoing;
+#ifdef _WIN32
+	return (unsigned long)GetTickCount();
+#else
+	struct timeval tv;
 
-	sin_size = (socklen_t)sizeof(struct sockaddr);
-	incoming = accept(sockin, (struct sockaddr *)&addrin,
-			&sin_size);
-	if (incoming < 0)
+	gettimeofday(&tv, NULL);
+	return (unsigned long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+
+
+/* Microseconds, for coalescing deadlines; wraps like get_time_ms(). */
+static unsigned long get_time_us(void)
+{
+#ifdef _WIN32
+	return (unsigned long)GetTickCount() * 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+
+
+static void print_stats(void)
+{
+	printf("active=%d accepted=%lu connect_failed=%lu "
+		"ports_exhausted=%lu\n"
+		"overload: reset=%lu queued=%lu expired=%lu shed=%lu "
+		"waiting=%d\n"
+		"out of fds: %lu\n"
+		"arena: %luK of %luK carved%s, %d buffers in use\n",
+		active_connections, stat_accepted, stat_connect_failed,
+		stat_ports_exhausted, stat_overload_reset,
+		stat_overload_queued, stat_queue_expired,
+		stat_overload_shed, num_queued, stat_fd_exhausted,
+		(unsigned long)(arena_used >> 10),
+		(unsigned long)(arena_size >> 10),
+		arena_huge ? " (hugetlb)" : "", buffers_in_use);
+	if (use_sockmap)
+		printf("sockmap: offloaded=%lu failed=%lu draining=%d "
+			"bytes moved by closed connections=%lu\n",
+			stat_offloaded, stat_offload_failed, num_draining,
+			stat_kernel_bytes);
+	if (reverse != REVERSE_NONE)
+		printf("pool: idle=%d claimed=%lu died idle=%lu\n",
+			pool_count, stat_pool_claimed, stat_pool_died);
+	if (num_acl_sources)
+		printf("access lists: denied=%lu\n", stat_denied);
+	if (spill_dir != NULL)
+		printf("spill: files=%d spilled=%lu failed=%lu\n",
+			num_spilling, stat_spilled, stat_spill_failed);
+	if (coalesce_min)
+		printf("coalescing: reads held back=%lu\n", stat_coalesced);
+	if (classify != CLASSIFY_NONE)
 	{
-		printf("accept() freaked out.\n");
-		return;
+		int k, bulk = 0;
+
+		for (k=0; k<slots_used; k++)
+			if (traffic_class[slot_list[k]] == TRAFFIC_BULK)
+				bulk++;
+		printf("classes: interactive=%d bulk=%d reclassified=%lu\n",
+			active_connections - bulk, bulk, stat_reclassified);
 	}
+#ifdef HAVE_WORKERS
+	if (num_workers > 1)
+		printf("worker %d of %d: %luK/s handed off=%lu "
+			"taken over=%lu\n", worker, num_workers,
+			loads[worker].rate >> 10, stat_handed_off,
+			stat_taken_over);
+#endif
+	if (usage != NULL)
+	{
+		unsigned int i, top[USAGE_TOP];
+		int j, num_top = 0;
+		struct in_addr addr;
 
-	active_connections++;
-	if (verbose)
-		printf("Got a connection from %s:%u. active=%d\n",
-			inet_ntoa(addrin.sin_addr),
-			ntohs(addrin.sin_port),
-			active_connections);
+		printf("usage: groups=%u table full=%lu over quota=%lu\n",
+			usage_hdr->used, stat_usage_full, stat_over_quota);
 
-	if (active_connections > max_connections)
+		/* the heaviest groups, as of their connections' last fold */
+		for (i=0; i<usage_hdr->entries; i++)
+		{
+			if (!(usage[i].flags & USAGE_USED)) continue;
+			for (j=num_top; j>0 && usage[top[j-1]].from_client +
+				usage[top[j-1]].to_client < usage[i].from_client +
+				usage[i].to_client; j--)
+				if (j < USAGE_TOP) top[j] = top[j-1];
+			if (j < USAGE_TOP) top[j] = i;
+			if (num_top < USAGE_TOP) num_top++;
+		}
+		for (j=0; j<num_top; j++)
+		{
+			addr.s_addr = htonl(usage[top[j]].net);
+			printf("  %s/%d: from client=%llu to client=%llu "
+				"connections=%u\n", inet_ntoa(addr), usage_bits,
+				usage[top[j]].from_client,
+				usage[top[j]].to_client,
+				usage[top[j]].connections);
+		}
+	}
+	if (num_routes)
 	{
-		printf("ERROR: Maximum limit reached."
-			"This should not happen!\n");
-		closesocket(incoming);
-		active_connections--;
-		return;
+		int i;
+
+		printf("routing: waiting=%d routed=%lu to the default=%lu\n",
+			num_sniffing, stat_routed, stat_route_default);
+		for (i=0; i<NUM_PROTOS; i++)
+			printf("%s%s=%lu", i ? " " : "protocols: ",
+				proto_names[i], stat_protos[i]);
+		printf("\n");
 	}
+	if (tunnel != TUNNEL_NONE)
+	{
+		int i, up = 0;
 
-	/* enqueue */
-	for (i=0; (i<max_connections) && (curr<0); i++)
-		if ((conn_in[i] == INVALID_SOCKET) &&
-			(conn_out[i] == INVALID_SOCKET))
-				curr = i;
+		for (i=0; i<num_links; i++)
+			if (links[i].s != INVALID_SOCKET &&
+			    !links[i].connecting)
+				up++;
+		printf("tunnel: links up=%d streams opened=%lu "
+			"frames reordered=%lu\n", up, stat_streams,
+			stat_reordered);
+		if (stat_pack_in || stat_pack_skipped)
+			printf("compression: %lu bytes packed into %lu, "
+				"%lu sent as they were\n", stat_pack_in,
+				stat_pack_out, stat_pack_skipped);
+	}
+	fflush(stdout);
+}
 
-	if (curr == -1) ERR("couldn't enqueue connection");
 
-	/* create the outgoing socket */
-	outgoing = socket(AF_INET, SOCK_STREAM, 0);
-	if (outgoing < 0)
-		ERR("problem creating outgoing socket");
 
-	addrout.sin_family = AF_INET;
-	addrout.sin_port = htons(remoteport);
-	addrout.sin_addr.s_addr = inet_addr(remotehost);
-	memset(&(addrout.sin_zero), 0, 8);
+/* Give the outgoing socket a source address from the pool and/or a port
+ * from the configured range.  Without a range, IP_BIND_ADDRESS_NO_PORT
+ * defers the port choice to connect(), which can then reuse a port for
+ * any destination the 4-tuple allows instead of reserving it outright.
+ */
+static int bind_outgoing(const SOCKET s)
+{
+	struct sockaddr_in addr;
+	int tries, range, one = 1;
 
-	/* connect to the remote server */
-	if (connect(outgoing, (struct sockaddr *)&addrout,
-				sizeof(struct sockaddr)) < 0)
-		ERR("problem connect()ing outgoing socket");
+	if (!num_srcaddrs && !srcport_lo) return 0;
 
-	conn_in[curr] = incoming;
-	conn_out[curr] = outgoing;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	if (num_srcaddrs)
+	{
+		addr.sin_addr = srcaddrs[next_srcaddr];
+		next_srcaddr = (next_srcaddr + 1) % num_srcaddrs;
+	}
+
+	if (!srcport_lo)
+	{
+#ifdef IP_BIND_ADDRESS_NO_PORT
+		(void) setsockopt(s, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+			(char*)&one, sizeof(one));
+#endif
+		addr.sin_port = 0;
+		return bind(s, (struct sockaddr *)&addr, sizeof(addr));
+	}
+
+	/* ports in TIME_WAIT are fine as long as the 4-tuple differs */
+	(void) setsockopt(s, SOL_SOCKET, SO_REUSEADDR,
+		(char*)&one, sizeof(one));
+
+	range = srcport_hi - srcport_lo + 1;
+	for (tries=0; tries<range; tries++)
+	{
+		addr.sin_port = htons(srcport_lo + srcport_next);
+		srcport_next = (srcport_next + 1) % range;
+		if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return 0;
+		if (errno != EADDRINUSE) return -1;
+	}
+	return -1;
 }
 
 
 
-static void kill_connection(const int n)
+/* Couldn't reach the server: drop the client, but keep running. */
+static void connect_failed(const SOCKET incoming, const SOCKET outgoing)
 {
-	closesocket(conn_in[n]);
-	closesocket(conn_out[n]);
-	backlog_in_size[n] = backlog_out_size[n] =
-		backlog_in_pos[n] = backlog_out_pos[n] = 0;
+	if (errno == EADDRNOTAVAIL || errno == EADDRINUSE)
+		stat_ports_exhausted++;
+	else
+		stat_connect_failed++;
 
-	conn_in[n] = INVALID_SOCKET;
-	conn_out[n] = INVALID_SOCKET;
+	if (verbose)
+		printf("problem connect()ing outgoing socket: %s\n",
+			strerror(errno));
 
+	if (incoming != TUNNEL_SOCKET) closesocket(incoming);
+	closesocket(outgoing);
 	active_connections--;
-	if (verbose)
-		printf("Connection %d closed. active=%d\n", n,
-			active_connections);
 }
 
 
 
-static void add_backlog(const int n, const direction dir,
-	const char *buf, const int bufsize)
+#ifndef _WIN32
+/* Reserve one region for every buffer we could need: hugetlb pages if
+ * the system has some set aside, otherwise ordinary memory that asks
+ * for transparent huge pages.  With -mlock it's also faulted in and
+ * pinned up front.
+ */
+static void init_arena(void)
 {
-	char **backlog    = (dir==IN)?backlog_in     :backlog_out;
-	int *backlog_size = (dir==IN)?backlog_in_size:backlog_out_size;
-	int *backlog_pos  = (dir==IN)?backlog_in_pos :backlog_out_pos;
+	size_t size;
+	void *p = MAP_FAILED;
+	int i;
+
+	if (arena_mb == 0) return;
+	if (arena_mb > 0)
+		size = (size_t)arena_mb << 20;
+	else
+	{
+		/* enough for both directions of every slot to need one
+		 * buffer of each class, up to a point */
+		size = 0;
+		for (i=0; i<(tunnel ? NUM_CLASSES : READ_CLASSES); i++)
+			size += class_size[i] + 4096;
+		size *= 2 * (size_t)max_connections;
+		if (size > MAX_DEFAULT_ARENA) size = MAX_DEFAULT_ARENA;
+	}
+	size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	arena_huge = (p != MAP_FAILED);
+#endif
+	if (p == MAP_FAILED)
+	{
+#ifdef MAP_NORESERVE
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#else
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
+		if (p == MAP_FAILED)
+		{
+			printf("Can't reserve a %luM buffer arena, "
+				"using malloc().\n",
+				(unsigned long)(size >> 20));
+			return;
+		}
+#ifdef MADV_HUGEPAGE
+		(void) madvise(p, size, MADV_HUGEPAGE);
+#endif
+	}
 
-	if (backlog_pos[n] + backlog_size[n] + bufsize > BACKLOG_SIZE)
-		ERR("Backlog for connection %d exceeded %d bytes.\n",
-			n, BACKLOG_SIZE);
+	if (lock_arena && mlock(p, size) < 0)
+		ERR("can't mlock() the %luM buffer arena",
+			(unsigned long)(size >> 20));
 
-	memcpy(backlog[n] + backlog_pos[n] + backlog_size[n],
-		buf, (size_t )bufsize);
-	backlog_size[n] += bufsize;
+	arena = (char*)p;
+	arena_size = size;
 
-	if (verbose)
-		printf("Backlogged %d bytes (%d total) for connection %d\n",
-			bufsize, backlog_size[n], n);
+	if (verbose) printf("Buffer arena: %luM%s\n",
+		(unsigned long)(size >> 20),
+		arena_huge ? " of hugetlb pages" : "");
 }
+#endif
 
 
 
-static void flush_backlog(const int n, const direction dir)
+static int in_arena(const char *buf)
 {
-	SOCKET *conn      = (dir==IN)?conn_in        :conn_out;
-	char **backlog    = (dir==IN)?backlog_in     :backlog_out;
-	int *backlog_size = (dir==IN)?backlog_in_size:backlog_out_size;
-	int *backlog_pos  = (dir==IN)?backlog_in_pos :backlog_out_pos;
-	int sent;
-
-	sent = (int)send(conn[n], backlog[n] + backlog_pos[n],
-		backlog_size[n], MSG_DONTWAIT);
+	return arena != NULL && buf >= arena && buf < arena + arena_size;
+}
 
-	if (sent < 1)
-	{
-		if (verbose)
-		{
-			printf("send() returned %d. ", sent);
-			if (sent == -1) printf("errno=%d ", errno);
-			printf("\n");
-		}
-		kill_connection(n);
-		return;
-	}
 
-	if (verbose) printf("connection %d: sent %d of %d backlog\n",
-		n, sent, backlog_size[n]);
 
-	backlog_size[n] -= sent;
+/* Bytes each buffer of a class takes up in the arena.  Cache line
+ * aligned, or page aligned with zerocopy so retire_buffer() can drop
+ * the pages.
+ */
+static size_t carve_size(const int cls)
+{
+	size_t align = page_buffers ? 4096 : 64;
 
-	if (backlog_size[n] == 0)
-		backlog_pos[n] = 0;
-	else
-		backlog_pos[n] += sent;
+	return ((size_t)class_size[cls] + align - 1) & ~(align - 1);
 }
 
 
 
-static void bounce(const SOCKET src, const SOCKET dest,
-	const int n, const direction dir)
+/* Backlog buffers are where data is received into and sent from.  Free
+ * ones are kept on a list per size class, linked through their first
+ * bytes.  New ones are carved from the arena, and only once that runs
+ * out do we go to the system for more.
+ */
+static char *alloc_buffer(const int cls)
 {
-	char buf[BACKLOG_SIZE];
-	int recvd, sent;
+	char *buf = free_buffers[cls];
 
-	recvd = (int)recv(src, buf, BACKLOG_SIZE, 0);
-	if (recvd < 1)
+	if (buf != NULL)
 	{
-		if (verbose)
-		{
-			printf("recv() returned %d. ", recvd);
-			if (recvd == -1) printf("errno=%d ", errno);
-			printf("\n");
-		}
-		kill_connection(n);
-		return;
+		free_buffers[cls] = *(char**)buf;
+		return buf;
 	}
 
-	if (verbose)
+	if (arena != NULL && arena_used + carve_size(cls) <= arena_size)
 	{
-		printf("connection %d: recvd %d and ", n, recvd);
-		fflush(stdout);
+		buf = arena + arena_used;
+		arena_used += carve_size(cls);
+		return buf;
 	}
-
-	sent = (int)send(dest, buf, recvd, MSG_DONTWAIT);
-	if (sent < 1)
+#ifndef _WIN32
+	if (page_buffers)
 	{
-		if (verbose)
-		{
-			printf("send() returned %d. ", sent);
-			if (sent == -1) printf("errno=%d ", errno);
-			printf("\n");
-		}
-		kill_connection(n);
-		return;
+		void *p = mmap(NULL, class_size[cls], PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return (p == MAP_FAILED) ? NULL : (char*)p;
 	}
-	if (verbose) printf("sent %d\n", sent);
-	if (sent < recvd) add_backlog(n, dir, buf+sent, recvd-sent);
+#endif
+	return (char*)malloc(class_size[cls]);
 }
 
 
 
-static void broken_pipe(const int signum)
+static void free_buffer(char *buf, const int cls)
+{
+	*(char**)buf = free_buffers[cls];
+	free_buffers[cls] = buf;
+}
+
+
+
+/* Give memory that wasn't carved from the arena back to the system. */
+static void destroy_buffer(char *buf, const int cls)
+{
+	if (buf == NULL || in_arena(buf)) return;
+#ifndef _WIN32
+	if (page_buffers)
+	{
+		munmap(buf, class_size[cls]);
+		return;
+	}
+#endif
+	free(buf);
+}
+
+
+
+#ifdef HAVE_ZEROCOPY
+/* The kernel may still be sending from this buffer.  Leave it the pages
+ * and never touch them again: in the arena, drop them from our mapping
+ * so the buffer can be reused on fresh pages; otherwise unmap it.  A
+ * hugetlb arena can't drop part of a page, so the buffer is abandoned.
+ */
+static void retire_buffer(char *buf, const int cls)
+{
+	if (!in_arena(buf))
+		destroy_buffer(buf, cls);
+#ifdef MADV_DONTNEED
+	else if (madvise(buf, carve_size(cls), MADV_DONTNEED) == 0)
+		free_buffer(buf, cls);
+#endif
+	else if (verbose)
+		printf("Abandoning a %d byte buffer the kernel holds\n",
+			class_size[cls]);
+}
+#endif
+
+
+
+/* Close with an RST rather than a FIN, so the client fails fast. */
+static void reset_socket(const SOCKET s)
+{
+	struct linger lg;
+
+	lg.l_onoff = 1;
+	lg.l_linger = 0;
+	(void) setsockopt(s, SOL_SOCKET, SO_LINGER, (char*)&lg, sizeof(lg));
+	closesocket(s);
+}
+
+
+
+/* Out of descriptors (or memory): stop polling sockin for a while, and
+ * back off exponentially while it keeps happening.
+ */
+static void pause_accepting(void)
+{
+	if (accept_backoff == 0)
+		accept_backoff = 10;
+	else if (accept_backoff < 1000)
+		accept_backoff *= 2;
+	accept_resume = now + accept_backoff;
+	stat_fd_exhausted++;
+
+	if (verbose) printf("Out of descriptors, not accepting "
+		"for %lums\n", accept_backoff);
+}
+
+
+
+static int accept_paused(void)
+{
+	return accept_backoff && (long)(now - accept_resume) < 0;
+}
+
+
+
+/* How many bytes a connection may receive per direction per pass. */
+static int client_budget(const SOCKET s)
+{
+	struct sockaddr_in addr;
+	socklen_t len = (socklen_t)sizeof(addr);
+	unsigned long ip;
+	int i;
+
+	if (num_weights &&
+	    getpeername(s, (struct sockaddr *)&addr, &len) == 0)
+	{
+		ip = ntohl(addr.sin_addr.s_addr);
+		for (i=0; i<num_weights; i++)
+			if ((ip & weights[i].mask) == weights[i].net)
+			{
+				if (byte_budget > MAX_BUDGET /
+						weights[i].weight)
+					return MAX_BUDGET;
+				return byte_budget * weights[i].weight;
+			}
+	}
+	return byte_budget;
+}
+
+
+
+/* Have slot n serviced on the next pass. */
+static void wake(const int n)
+{
+	if (is_ready[n]) return;
+	is_ready[n] = READY_NEXT;
+	ready_list[num_ready++] = n;
+}
+
+
+
+/* The usage entry for clients from ip (host order), added if add is
+ * set.  Returns -1 if it isn't there or the table is too full.
+ */
+static int usage_slot(const unsigned long ip, const int add)
+{
+	unsigned int net, i;
+	int gone = -1;
+
+	net = (unsigned int)(ip & (usage_bits ?
+		0xFFFFFFFFUL << (32 - usage_bits) & 0xFFFFFFFFUL : 0));
+	for (i = (net * 2654435761U) >> usage_shift; ;
+	     i = (i + 1) & (usage_hdr->entries - 1))
+	{
+		if (usage[i].flags & USAGE_USED)
+		{
+			if (usage[i].net == net) return (int)i;
+			continue;
+		}
+		if (usage[i].flags & USAGE_GONE)
+		{
+			/* the first retired entry is where we'd add it */
+			if (gone < 0) gone = (int)i;
+			continue;
+		}
+
+		/* never used: the end of the probe */
+		if (!add) return -1;
+		if (gone >= 0) i = (unsigned int)gone;
+		else if (usage_hdr->used >= usage_hdr->entries / 4 * 3)
+			return -1;	/* keep probes short: at most 3/4 full */
+		else usage_hdr->used++;
+		memset(usage + i, 0, sizeof(*usage));
+		usage[i].net = net;
+		usage[i].flags = USAGE_USED;
+		return (int)i;
+	}
+}
+
+
+
+static unsigned long long usage_total(const int c)
+{
+	return usage[c].from_client + usage[c].to_client;
+}
+
+
+
+/* Map the -usage file, making it if it's new.  Returns 0, having said
+ * why, if it can't be used.
+ */
+static int open_usage(void)
+{
+#ifdef _WIN32
+	printf("Usage tables need mmap, which we don't have here.\n");
+	return 0;
+#else
+	struct stat st;
+	size_t size;
+	void *map;
+	int fd, fresh;
+
+	fd = open(usage_path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		printf("Can't open %s: %s\n", usage_path, strerror(errno));
+		return 0;
+	}
+	fresh = (st.st_size == 0);
+	size = sizeof(struct usage_header) + (fresh ? USAGE_ENTRIES :
+		(st.st_size - sizeof(struct usage_header)) /
+		sizeof(struct usage_entry)) * sizeof(struct usage_entry);
+	if ((fresh && ftruncate(fd, (off_t)size) < 0) ||
+	    (!fresh && (size_t)st.st_size != size))
+	{
+		printf("%s isn't a usage table.\n", usage_path);
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		printf("Can't map %s: %s\n", usage_path, strerror(errno));
+		return 0;
+	}
+
+	usage_hdr = (struct usage_header*)map;
+	usage = (struct usage_entry*)(usage_hdr + 1);
+	if (fresh)
+	{
+		memcpy(usage_hdr->magic, USAGE_MAGIC, 8);
+		usage_hdr->since = (unsigned long long)time(NULL);
+		usage_hdr->entries = USAGE_ENTRIES;
+		usage_hdr->bits = (unsigned int)usage_bits;
+		usage_hdr->version = USAGE_VERSION;
+	}
+	if (memcmp(usage_hdr->magic, USAGE_MAGIC, 8) != 0 ||
+	    usage_hdr->version != USAGE_VERSION ||
+	    usage_hdr->entries == 0 ||
+	    (usage_hdr->entries & (usage_hdr->entries - 1)) != 0 ||
+	    sizeof(*usage_hdr) + usage_hdr->entries * sizeof(*usage) != size)
+	{
+		printf("%s isn't a usage table.\n", usage_path);
+		return 0;
+	}
+	if (usage_hdr->bits != (unsigned int)usage_bits)
+	{
+		printf("%s groups clients by /%u, not /%d.\n", usage_path,
+			usage_hdr->bits, usage_bits);
+		return 0;
+	}
+	for (usage_shift = 32; (1U << (32 - usage_shift)) <
+			usage_hdr->entries; usage_shift--)
+		;
+	if (verbose)
+		printf("Usage table: %u of %u groups in use\n",
+			usage_hdr->used, usage_hdr->entries);
+	return 1;
+#endif
+}
+
+
+
+/* Point a new connection at its client's usage entry. */
+static void start_usage(const int n, const SOCKET incoming)
+{
+	struct sockaddr_in addr;
+	socklen_t len = (socklen_t)sizeof(addr);
+	int c = -1;
+
+	if (incoming != TUNNEL_SOCKET &&
+	    getpeername(incoming, (struct sockaddr *)&addr, &len) == 0)
+	{
+		c = usage_slot(ntohl(addr.sin_addr.s_addr), 1);
+		if (c < 0) stat_usage_full++;
+	}
+	conn_client[n] = c;
+	unfolded_in[n] = unfolded_out[n] = 0;
+	over_quota[n] = 0;
+	if (c < 0) return;
+
+	usage[c].connections++;
+	over_quota[n] = (quota && usage_total(c) >= quota);
+}
+
+
+
+/* Add what the connection has moved to its client's entry. */
+static void fold_usage(const int n)
+{
+	struct usage_entry *e = usage + conn_client[n];
+
+	e->from_client += unfolded_out[n];
+	e->to_client += unfolded_in[n];
+	unfolded_in[n] = unfolded_out[n] = 0;
+	if (quota && !over_quota[n] && usage_total(conn_client[n]) >= quota)
+	{
+		over_quota[n] = 1;
+		stat_over_quota++;
+		if (verbose) printf("connection %d: over quota\n", n);
+
+		/* to be closed, or throttled, on the next pass */
+		wake(n);
+		work_left = 1;
+	}
+}
+
+
+
+/* bounce() read bytes going dir on connection n. */
+static void charge_usage(const int n, const direction dir, const int bytes)
+{
+	unsigned long *unfolded = (dir==IN)?unfolded_in:unfolded_out;
+
+	unfolded[n] += bytes;
+	if (over_quota[n] && quota_rate)
+		usage_tokens[conn_client[n]] -= bytes;
+	if (unfolded_in[n] + unfolded_out[n] >= USAGE_FOLD)
+		fold_usage(n);
+}
+
+
+
+/* How much a throttled group may move right now. */
+static long quota_allowance(const int c)
+{
+	long elapsed = (long)(now - usage_refilled[c]);
+
+	if (elapsed > 0)
+	{
+		usage_refilled[c] = now;
+		usage_tokens[c] += (elapsed >= 1000) ? quota_rate :
+			(long)((double)quota_rate * elapsed / 1000);
+		if (usage_tokens[c] > quota_rate)
+			usage_tokens[c] = quota_rate;
+	}
+	return usage_tokens[c];
+}
+
+
+
+static int popcount64(unsigned long long x)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(x);
+#else
+	int n;
+
+	for (n=0; x; n++)
+		x &= x - 1;
+	return n;
+#endif
+}
+
+
+
+/* The slot for addr in a trie node depth bits down.  Addresses are
+ * taken as 36 bits, so the last node's 2 bits fill out a whole stride.
+ */
+static int acl_slot(const unsigned long addr, const int depth)
+{
+	return (int)(((depth <= 32 - ACL_STRIDE) ?
+		addr >> (32 - ACL_STRIDE - depth) :
+		addr << (depth - 32 + ACL_STRIDE)) & ((1 << ACL_STRIDE) - 1));
+}
+
+
+
+/* Non-zero if a client from addr (host order) is to be turned away. */
+static int acl_denied(const unsigned long addr)
+{
+	const struct acl_node *node = acl;
+	int depth, slot;
+
+	for (depth=0; ; depth+=ACL_STRIDE)
+	{
+		slot = acl_slot(addr, depth);
+		if (!((node->children >> slot) & 1))
+			return (int)((node->denied >> slot) & 1);
+		node = acl + node->base + popcount64(node->children &
+			((1ULL << slot) - 1));
+	}
+}
+
+
+
+/* A trie being built from prefixes sorted by acl_order(). */
+struct acl_build {
+	struct acl_node *nodes;
+	int count, cap;
+	struct acl_prefix {
+		unsigned long net;
+		int bits, deny;
+	} *prefixes;
+};
+
+
+
+static int acl_order(const void *a, const void *b)
+{
+	const struct acl_prefix *x = (const struct acl_prefix *)a,
+				*y = (const struct acl_prefix *)b;
+
+	if (x->net != y->net) return (x->net < y->net) ? -1 : 1;
+	if (x->bits != y->bits) return x->bits - y->bits;
+	return x->deny - y->deny;	/* in both lists: deny wins */
+}
+
+
+
+/* Fill in node n, depth bits down, from prefixes lo to hi-1, which all
+ * lie under it.  Slots no prefix covers get inherited, what the nearest
+ * shorter prefix says.  Returns 0 if out of memory.
+ */
+static int acl_fill(struct acl_build *b, const int n, const int depth,
+	const int lo, const int hi, const int inherited)
+{
+	unsigned char paint[1 << ACL_STRIDE];
+	unsigned long long children = 0, denied = 0;
+	struct acl_node *grown;
+	int i, j, bits, first, slot, child;
+
+	/* shorter prefixes first, so longer ones paint over them */
+	memset(paint, inherited, sizeof(paint));
+	for (bits = depth ? depth + 1 : 0;
+	     bits <= depth + ACL_STRIDE && bits <= 32; bits++)
+		for (i=lo; i<hi; i++)
+			if (b->prefixes[i].bits == bits)
+			{
+				first = acl_slot(b->prefixes[i].net, depth);
+				for (j=0; j < 1 << (depth+ACL_STRIDE-bits); j++)
+					paint[first + j] =
+						(unsigned char)b->prefixes[i].deny;
+			}
+
+	for (i=lo; i<hi; i++)
+		if (b->prefixes[i].bits > depth + ACL_STRIDE)
+			children |= 1ULL << acl_slot(b->prefixes[i].net, depth);
+	for (slot=0; slot < 1 << ACL_STRIDE; slot++)
+		if (paint[slot]) denied |= 1ULL << slot;
+
+	/* room for the children, side by side */
+	if (b->count + popcount64(children) > b->cap)
+	{
+		b->cap = 2 * b->cap + popcount64(children);
+		grown = (struct acl_node*)realloc(b->nodes,
+			b->cap * sizeof(struct acl_node));
+		if (grown == NULL) return 0;
+		b->nodes = grown;
+	}
+	b->nodes[n].children = children;
+	b->nodes[n].denied = denied;
+	b->nodes[n].base = (unsigned int)b->count;
+	child = b->count;
+	b->count += popcount64(children);
+
+	/* the prefixes under each slot are together, since they're sorted */
+	for (i=lo; i<hi; i=j)
+	{
+		slot = acl_slot(b->prefixes[i].net, depth);
+		for (j=i+1; j<hi &&
+			    acl_slot(b->prefixes[j].net, depth) == slot; j++)
+			;
+		if (((children >> slot) & 1) &&
+		    !acl_fill(b, child++, depth + ACL_STRIDE, i, j,
+				paint[slot]))
+			return 0;
+	}
+	return 1;
+}
+
+
+
+/* Build a trie from the -allow and -deny files.  Returns NULL, having
+ * said why, if they can't be read or don't make sense.
+ */
+static struct acl_node *load_acl(void)
+{
+	struct acl_build b;
+	struct acl_prefix *grown;
+	char line[256], net[32];
+	FILE *f;
+	int i, n = 0, cap = 0, num_allow = 0, skipped = 0, lineno, ok = 1;
+
+	memset(&b, 0, sizeof(b));
+	for (i=0; i<num_acl_sources && ok; i++)
+	{
+		f = fopen(acl_sources[i].path, "r");
+		if (f == NULL)
+		{
+			printf("Can't read %s: %s\n", acl_sources[i].path,
+				strerror(errno));
+			ok = 0;
+			break;
+		}
+		for (lineno=1; ok && fgets(line, sizeof(line), f) != NULL;
+		     lineno++)
+		{
+			int bits = 32;
+			char *p = line + strspn(line, " \t");
+
+			if (*p == '#' || *p == '\n' || *p == '\r' || !*p)
+				continue;
+			/* we only listen on IPv4 */
+			if (strchr(p, ':') != NULL)
+			{
+				skipped++;
+				continue;
+			}
+			if (n == cap)
+			{
+				cap = 2 * cap + 64;
+				grown = (struct acl_prefix*)realloc(
+					b.prefixes, cap * sizeof(*grown));
+				if (grown == NULL)
+					ERR("Can't allocate access lists.");
+				b.prefixes = grown;
+			}
+			if (sscanf(p, "%31[0-9.]/%d", net, &bits) < 1 ||
+			    inet_addr(net) == INADDR_NONE ||
+			    bits < 0 || bits > 32)
+			{
+				printf("%s:%d: '%s' is a silly prefix.\n",
+					acl_sources[i].path, lineno,
+					strtok(p, " \t\r\n"));
+				ok = 0;
+				break;
+			}
+			b.prefixes[n].bits = bits;
+			b.prefixes[n].net = ntohl(inet_addr(net)) & (bits ?
+				0xFFFFFFFFUL << (32 - bits) & 0xFFFFFFFFUL : 0);
+			b.prefixes[n].deny = acl_sources[i].deny;
+			if (!acl_sources[i].deny) num_allow++;
+			n++;
+		}
+		fclose(f);
+	}
+
+	if (ok)
+	{
+		qsort(b.prefixes, n, sizeof(*b.prefixes), acl_order);
+		b.cap = 1 + n;
+		b.count = 1;
+		b.nodes = (struct acl_node*)malloc(b.cap * sizeof(*b.nodes));
+		if (b.nodes == NULL || !acl_fill(&b, 0, 0, 0, n, num_allow != 0))
+			ERR("Can't allocate access lists.");
+		if (verbose)
+			printf("Access lists: %d prefixes in %d nodes (%luK)\n",
+				n, b.count, (unsigned long)(b.count *
+				sizeof(*b.nodes) >> 10));
+		if (skipped)
+			printf("Skipped %d IPv6 prefixes, clients only come "
+				"in over IPv4.\n", skipped);
+	}
+	free(b.prefixes);
+	return ok ? b.nodes : NULL;
+}
+
+
+
+#ifdef HAVE_ACL_FILTER
+/*
+ * The access lists as a classic BPF filter on sockin, so the kernel
+ * drops SYNs from denied clients before they take up a place in the
+ * accept queue.  The trie is flattened into runs of addresses that are
+ * all allowed or all denied, and the filter is a binary search over
+ * where the runs start.  Accepted sockets inherit the filter, so
+ * anything that isn't a SYN passes straight away.
+ */
+struct acl_run {
+	unsigned long start;
+	int deny;
+};
+
+
+
+/* Append the runs under node, depth bits down, whose addresses all
+ * start with base.  Returns 0 if there are more than max.
+ */
+static int acl_flatten(struct acl_run *runs, int *count, const int max,
+	const struct acl_node *node, const int depth,
+	const unsigned long base)
+{
+	int slot, child = (int)node->base, deny;
+	unsigned long start;
+
+	for (slot=0; slot < 1 << ACL_STRIDE; slot++)
+	{
+		/* the last node has 2 real bits and 4 of padding */
+		if (depth > 32 - ACL_STRIDE &&
+		    (slot & ((1 << (depth - 32 + ACL_STRIDE)) - 1)))
+			continue;
+		start = base | ((depth <= 32 - ACL_STRIDE) ?
+			(unsigned long)slot << (32 - ACL_STRIDE - depth) :
+			(unsigned long)slot >> (depth - 32 + ACL_STRIDE));
+
+		if ((node->children >> slot) & 1)
+		{
+			if (!acl_flatten(runs, count, max, acl + child++,
+					depth + ACL_STRIDE, start))
+				return 0;
+			continue;
+		}
+		deny = (int)((node->denied >> slot) & 1);
+		if (*count && runs[*count - 1].deny == deny)
+			continue;
+		if (*count == max) return 0;
+		runs[*count].start = start;
+		runs[*count].deny = deny;
+		(*count)++;
+	}
+	return 1;
+}
+
+
+
+/* Instructions needed to search runs lo to hi-1.  A jump can only skip
+ * 255 instructions, so a bigger left half costs an extra BPF_JA.
+ */
+static int search_size(const int lo, const int hi)
+{
+	int left, right;
+
+	if (hi - lo == 1) return 1;
+	left = search_size(lo, (lo + hi) / 2);
+	right = search_size((lo + hi) / 2, hi);
+	return ((left > 255) ? 2 : 1) + left + right;
+}
+
+
+
+/* Emit the search for runs lo to hi-1 at prog[at], with the client's
+ * address in A.  Returns where it ended.
+ */
+static int emit_search(struct sock_filter *prog, int at,
+	const struct acl_run *runs, const int lo, const int hi)
+{
+	struct sock_filter insn;
+	int mid = (lo + hi) / 2, left;
+
+	memset(&insn, 0, sizeof(insn));
+	if (hi - lo == 1)
+	{
+		insn.code = BPF_RET|BPF_K;
+		insn.k = runs[lo].deny ? 0 : 0xFFFFFFFFU;
+		prog[at] = insn;
+		return at + 1;
+	}
+
+	left = search_size(lo, mid);
+	insn.code = BPF_JMP|BPF_JGE|BPF_K;
+	insn.k = (unsigned int)runs[mid].start;
+	if (left <= 255)
+	{
+		insn.jt = (unsigned char)left;
+		prog[at++] = insn;
+	}
+	else
+	{
+		insn.jf = 1;
+		prog[at++] = insn;
+		memset(&insn, 0, sizeof(insn));
+		insn.code = BPF_JMP|BPF_JA;
+		insn.k = (unsigned int)left;
+		prog[at++] = insn;
+	}
+	at = emit_search(prog, at, runs, lo, mid);
+	return emit_search(prog, at, runs, mid, hi);
+}
+
+
+
+/* Put the access lists as they are now on sockin.  If they don't fit in
+ * a filter, take off the old one and leave acl_denied() to do it all.
+ */
+static void filter_acl(void)
+{
+	/* a SYN?  (skb data starts at the TCP header) */
+	static const struct sock_filter head[] = {
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 13),
+		BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x02, 1, 0),
+		BPF_STMT(BPF_RET|BPF_K, 0xFFFFFFFFU),
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF + 12)
+	};
+	const int head_len = sizeof(head) / sizeof(head[0]);
+	struct sock_filter *prog;
+	struct sock_fprog fprog;
+	struct acl_run *runs;
+	int num_runs = 0, len = 0, ok;
+
+	runs = (struct acl_run*)malloc(BPF_MAXINSNS * sizeof(*runs));
+	prog = (struct sock_filter*)malloc(BPF_MAXINSNS * sizeof(*prog));
+	ok = (runs != NULL && prog != NULL &&
+		acl_flatten(runs, &num_runs, BPF_MAXINSNS - head_len, acl,
+			0, 0));
+	if (ok)
+	{
+		len = head_len + search_size(0, num_runs);
+		ok = (len <= BPF_MAXINSNS);
+	}
+	if (ok)
+	{
+		memcpy(prog, head, sizeof(head));
+		(void) emit_search(prog, head_len, runs, 0, num_runs);
+		fprog.len = (unsigned short)len;
+		fprog.filter = prog;
+		ok = (setsockopt(sockin, SOL_SOCKET, SO_ATTACH_FILTER,
+			(char*)&fprog, sizeof(fprog)) == 0);
+		if (!ok)
+			printf("Can't attach socket filter: %s\n",
+				strerror(errno));
+	}
+	else
+		printf("Access lists are too long for a socket filter.\n");
+
+	if (ok)
+	{
+		if (verbose)
+			printf("Access lists: %d ranges in a %d instruction "
+				"socket filter\n", num_runs, len);
+	}
+	else
+	{
+		(void) setsockopt(sockin, SOL_SOCKET, SO_DETACH_FILTER,
+			NULL, 0);
+		printf("Checking clients after accept only.\n");
+	}
+	free(runs);
+	free(prog);
+}
+#endif /* HAVE_ACL_FILTER */
+
+
+
+/* SIGHUP: swap in the access lists as they are now, if they make sense. */
+static void reload_acl(void)
+{
+	struct acl_node *fresh;
+
+	if (!num_acl_sources) return;
+	fresh = load_acl();
+	if (fresh == NULL)
+	{
+		printf("Keeping the access lists as they were.\n");
+		return;
+	}
+	free(acl);
+	acl = fresh;
+#ifdef HAVE_ACL_FILTER
+	filter_acl();
+#endif
+	if (verbose) printf("Reloaded the access lists.\n");
+}
+
+
+
+static void set_nonblocking(const SOCKET s)
+{
+#ifdef _WIN32
+	u_long one = 1;
+
+	if (ioctlsocket(s, FIONBIO, &one) != 0)
+#else
+	if (fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK) < 0)
+#endif
+		ERR("can't make socket non-blocking");
+}
+
+
+
+static int valid_socket(const int i)
+{
+	if (conn_in[i] != INVALID_SOCKET && conn_out[i] != INVALID_SOCKET)
+		return 1;
+	else if (
+	(conn_in[i] == INVALID_SOCKET && conn_out[i] != INVALID_SOCKET) ||
+	(conn_in[i] != INVALID_SOCKET && conn_out[i] == INVALID_SOCKET)
+	)
+		ERR("internal inconsistency! in[%d]=%d, out[%d]=%d",
+			i, conn_in[i], i, conn_out[i]);
+
+	/* else both are INVALID */
+	return 0;
+}
+
+
+
+/* A slot for a new connection; it's taken once it's installed. */
+static int free_slot(void)
+{
+	if (slots_used < slots_seen)
+		return slot_list[slots_used];
+	if (slots_seen < max_connections)
+		return slots_seen;
+
+	ERR("couldn't enqueue connection");
+	return -1;
+}
+
+
+
+/* Swap where slots a and b are in slot_list. */
+static void swap_slots(const int a, const int b)
+{
+	int pa = slot_pos[a], pb = slot_pos[b];
+
+	slot_list[pa] = b;
+	slot_pos[b] = pa;
+	slot_list[pb] = a;
+	slot_pos[a] = pb;
+}
+
+
+
+/* Where clients on route go, or for -1 the remote from the command line. */
+static void target_address(struct sockaddr_in *addr, const int route)
+{
+	if (route >= 0)
+	{
+		*addr = routes[route].addr;
+		return;
+	}
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(remoteport);
+	addr->sin_addr.s_addr = inet_addr(remotehost);
+	memset(&(addr->sin_zero), 0, 8);
+}
+
+
+
+/* Mark both of n's sockets for its traffic class. */
+static void mark_connection(const int n)
+{
+	SOCKET s[2];
+	int i, bulk, tos, prio;
+
+	bulk = (traffic_class != NULL && traffic_class[n] == TRAFFIC_BULK);
+	tos = (dscp >= 0) ? dscp << 2 : bulk ? TOS_BULK : TOS_INTERACTIVE;
+	prio = bulk ? PRIO_BULK : PRIO_INTERACTIVE;
+
+	s[0] = conn_in[n];
+	s[1] = conn_out[n];
+	for (i=0; i<2; i++)
+	{
+		if (s[i] == TUNNEL_SOCKET) continue;
+
+		/* Linux resets the priority when the TOS changes */
+#ifdef IP_TOS
+		(void) setsockopt(s[i], IPPROTO_IP, IP_TOS,
+			(char*)&tos, sizeof(tos));
+#endif
+#ifdef SO_PRIORITY
+		if (classify != CLASSIFY_NONE)
+			(void) setsockopt(s[i], SOL_SOCKET, SO_PRIORITY,
+				(char*)&prio, sizeof(prio));
+#endif
+	}
+}
+
+
+
+/* Data moved for n: count it towards this window's bytes and duty. */
+static void note_traffic(const int n, const int bytes)
+{
+	window_bytes[n] += bytes;
+	if (busy_tick[n] != now)
+	{
+		busy_tick[n] = now;
+		busy_ms[n]++;
+	}
+}
+
+
+
+/* Move connections between classes by what they did in the window. */
+static void classify_connections(const long elapsed)
+{
+	int i, k, duty, avg, bulk;
+
+	for (k=0; k<slots_used; k++)
+	{
+		i = slot_list[k];
+		duty = (int)(busy_ms[i] * 100L / elapsed);
+		avg = max(read_in_avg[i], read_out_avg[i]);
+		if (traffic_class[i] == TRAFFIC_BULK)
+			bulk = (duty >= BULK_DUTY / 2 && avg >= BULK_READ / 2) ||
+				window_bytes[i] >= BULK_BYTES / 2;
+		else
+			bulk = (duty >= BULK_DUTY && avg >= BULK_READ) ||
+				window_bytes[i] >= BULK_BYTES;
+
+		if (bulk != (traffic_class[i] == TRAFFIC_BULK))
+		{
+			traffic_class[i] = bulk ? TRAFFIC_BULK :
+				TRAFFIC_INTERACTIVE;
+			mark_connection(i);
+			stat_reclassified++;
+			if (verbose) printf("connection %d: %s (duty %d%%, "
+				"reads %d, %lu bytes)\n", i, bulk ? "bulk" :
+				"interactive", duty, avg, window_bytes[i]);
+		}
+	}
+}
+
+
+
+/* Put a connected pair in slot curr.  Either side may be TUNNEL_SOCKET. */
+static void install_connection(const int curr, const SOCKET incoming,
+	const SOCKET outgoing)
+{
+	if (incoming != TUNNEL_SOCKET) set_nonblocking(incoming);
+	if (outgoing != TUNNEL_SOCKET) set_nonblocking(outgoing);
+
+	conn_in[curr] = incoming;
+	conn_out[curr] = outgoing;
+	if (curr == slots_seen)
+	{
+		slot_list[curr] = slot_pos[curr] = curr;
+		slots_seen++;
+	}
+	swap_slots(curr, slot_list[slots_used++]);
+	wake(curr);
+	last_active[curr] = now;
+	conn_budget[curr] = client_budget(incoming);
+	if (usage != NULL) start_usage(curr, incoming);
+#ifdef HAVE_SPILL
+	/* the most that's held in memory before spilling */
+	if (spill_mem)
+	{
+		(void) setsockopt(incoming, SOL_SOCKET, SO_SNDBUF,
+			(char*)&spill_mem, sizeof(spill_mem));
+		(void) setsockopt(outgoing, SOL_SOCKET, SO_SNDBUF,
+			(char*)&spill_mem, sizeof(spill_mem));
+	}
+#endif
+
+	/* assume writable until a send says otherwise */
+	conn_ready[curr] = WR_IN | WR_OUT;
+
+	if (classify != CLASSIFY_NONE)
+		traffic_class[curr] = (classify == CLASSIFY_BULK) ?
+			TRAFFIC_BULK : TRAFFIC_INTERACTIVE;
+	if (window_bytes != NULL)
+		busy_ms[curr] = window_bytes[curr] = 0;
+	if (classify != CLASSIFY_NONE || dscp >= 0) mark_connection(curr);
+
+#ifdef USE_EPOLL
+	{
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.u32 = (unsigned int)curr * 2;
+		if (incoming != TUNNEL_SOCKET &&
+		    epoll_ctl(epfd, EPOLL_CTL_ADD, incoming, &ev) < 0)
+			ERR("can't watch incoming socket");
+		ev.data.u32 = (unsigned int)curr * 2 + 1;
+		if (outgoing != TUNNEL_SOCKET &&
+		    epoll_ctl(epfd, EPOLL_CTL_ADD, outgoing, &ev) < 0)
+			ERR("can't watch outgoing socket");
+	}
+#endif
+}
+
+
+
+/* Keep s idle in the pool, watching for it to be claimed or closed. */
+static void pool_add(const SOCKET s)
+{
+	if (pool_count >= pool_size
+#if !defined(USE_EPOLL) && !defined(_WIN32)
+	    || s >= FD_SETSIZE
+#endif
+	    )
+	{
+		reset_socket(s);
+		return;
+	}
+	set_nonblocking(s);
+
+#ifdef USE_EPOLL
+	{
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.u32 = POOL_FLAG | (unsigned int)pool_count;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev) < 0)
+			ERR("can't watch pooled socket");
+	}
+#endif
+	pool[pool_count] = s;
+	pool_ready[pool_count] = 0;
+	pool_count++;
+}
+
+
+
+/* Take entry i out of the pool, leaving its socket open. */
+static SOCKET pool_take(const int i)
+{
+	SOCKET s = pool[i];
+
+	pool_count--;
+	pool[i] = pool[pool_count];
+	pool_ready[i] = pool_ready[pool_count];
+#ifdef USE_EPOLL
+	{
+		struct epoll_event ev;
+
+		(void) epoll_ctl(epfd, EPOLL_CTL_DEL, s, &ev);
+
+		/* the last entry's events now say where it's gone */
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.u32 = POOL_FLAG | (unsigned int)i;
+		if (i < pool_count &&
+		    epoll_ctl(epfd, EPOLL_CTL_MOD, pool[i], &ev) < 0)
+			ERR("can't watch pooled socket");
+	}
+#endif
+	return s;
+}
+
+
+
+/* Room for another client: a free slot, not held for one waiting to be
+ * routed, and, if clients are spliced onto pooled connections, an idle
+ * one. */
+static int have_capacity(void)
+{
+	return active_connections + num_sniffing < max_connections &&
+		(reverse != REVERSE_PUBLIC || pool_count > 0);
+}
+
+
+
+static void put32(char *p, const unsigned int x)
+{
+	p[0] = (char)(x >> 24);
+	p[1] = (char)(x >> 16);
+	p[2] = (char)(x >> 8);
+	p[3] = (char)x;
+}
+
+
+
+static unsigned int get32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+
+	return ((unsigned int)u[0] << 24) | ((unsigned int)u[1] << 16) |
+		((unsigned int)u[2] << 8) | u[3];
+}
+
+
+
+/* Queue the header of a frame on link l, and return where its len bytes
+ * of payload go.  DATA is kept within LINK_BUF_SIZE by its callers; the
+ * buffer grows if it has to, so control frames always fit.
+ */
+static char *link_frame(const int l, const int type, const unsigned int id,
+	const int len)
+{
+	struct link *k = &links[l];
+	char *p;
+
+	if (k->wlen + FRAME_HDR + len > k->wcap && k->wpos)
+	{
+		memmove(k->wbuf, k->wbuf + k->wpos, k->wlen - k->wpos);
+		k->wlen -= k->wpos;
+		k->wpos = 0;
+	}
+	if (k->wlen + FRAME_HDR + len > k->wcap)
+	{
+		k->wcap = max(2 * k->wcap, k->wlen + FRAME_HDR + len);
+		k->wbuf = (char*)realloc(k->wbuf, k->wcap);
+		if (k->wbuf == NULL) ERR("Can't grow link buffer.");
+	}
+
+	p = k->wbuf + k->wlen;
+	put32(p, id);
+	p[4] = (char)type;
+	p[5] = 0;
+	p[6] = (char)(len >> 8);
+	p[7] = (char)len;
+	k->wlen += FRAME_HDR + len;
+	return p + FRAME_HDR;
+}
+
+
+
+/* Queue a frame on link l. */
+static void link_write(const int l, const int type, const unsigned int id,
+	const char *data, const int len)
+{
+	char *p = link_frame(l, type, id, len);
+
+	if (len) memcpy(p, data, len);
+}
+
+
+
+/* Bytes the socket hasn't had acknowledged yet. */
+static int unsent(const SOCKET s)
+{
+	int outq = 0;
+
+#ifdef SIOCOUTQ
+	if (ioctl(s, SIOCOUTQ, &outq) < 0) return 0;
+#endif
+	return outq;
+}
+
+
+
+/* Send what's queued on link l, until done or the socket fills up. */
+static void flush_link(const int l)
+{
+	struct link *k = &links[l];
+	int sent;
+
+	while (k->wpos < k->wlen)
+	{
+		sent = (int)send(k->s, k->wbuf + k->wpos, k->wlen - k->wpos,
+			MSG_DONTWAIT);
+		if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			k->writable = 0;
+			k->inflight = unsent(k->s);
+			return;
+		}
+		if (sent < 1)
+		{
+			k->failed = 1;
+			return;
+		}
+		k->wpos += sent;
+	}
+	k->wpos = k->wlen = 0;
+	k->inflight = unsent(k->s);
+}
+
+
+
+/* Room for DATA on link l. */
+static int link_room(const int l)
+{
+	return LINK_BUF_SIZE - (links[l].wlen - links[l].wpos) - FRAME_HDR;
+}
+
+
+
+/* How far behind link l is: what it has queued here and in the kernel. */
+static int link_backlog(const int l)
+{
+	return links[l].wlen - links[l].wpos + links[l].inflight;
+}
+
+
+
+/* The link for stream n's next DATA: its own, or once striping is
+ * under way, whichever to the same peer is least backed up. */
+static int send_link(const int n)
+{
+	int l = stream_link[n], i;
+
+	if (l < 0 || (stream_flags[n] & (STREAM_STRIPED | STREAM_ACKED)) !=
+			(STREAM_STRIPED | STREAM_ACKED))
+		return l;
+
+	for (i=0; i<num_links; i++)
+		if (links[i].s != INVALID_SOCKET && !links[i].failed &&
+		    !links[i].connecting && links[i].peer == links[l].peer && link_room(i) > 4 &&
+		    (link_room(l) <= 4 || link_backlog(i) < link_backlog(l)))
+			l = i;
+	return l;
+}
+
+
+
+/* The codecs this build has, as a bitmask. */
+static int codecs_built(void)
+{
+	int mask = 0;
+
+#ifdef HAVE_LZ4
+	mask |= 1 << CODEC_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+	mask |= 1 << CODEC_ZSTD;
+#endif
+	return mask;
+}
+
+
+
+/* Compress len bytes into dst.  Returns the packed size, or 0 if it
+ * wouldn't come out smaller. */
+static int pack(const int codec, const char *src, const int len, char *dst)
+{
+	int packed = 0;
+
+#if !defined(HAVE_LZ4) && !defined(HAVE_ZSTD)
+	(void) src;
+	(void) len;
+	(void) dst;
+#endif
+	switch (codec)
+	{
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		packed = LZ4_compress_default(src, dst, len, len - 1);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		{
+			size_t z = ZSTD_compressCCtx(zstd_c, dst, len - 1,
+				src, len, ZSTD_LEVEL);
+
+			if (!ZSTD_isError(z)) packed = (int)z;
+		}
+		break;
+#endif
+	}
+	return packed;
+}
+
+
+
+/* Returns the unpacked size, or -1 if src is corrupt or won't fit in
+ * room bytes. */
+static int unpack(const int codec, const char *src, const int len,
+	char *dst, const int room)
+{
+	int got = -1;
+
+#if !defined(HAVE_LZ4) && !defined(HAVE_ZSTD)
+	(void) src;
+	(void) len;
+	(void) dst;
+	(void) room;
+#endif
+	switch (codec)
+	{
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		got = LZ4_decompress_safe(src, dst, len, room);
+		if (got < 0) got = -1;
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		{
+			size_t z = ZSTD_decompressDCtx(zstd_d, dst, room,
+				src, len);
+
+			if (!ZSTD_isError(z)) got = (int)z;
+		}
+		break;
+#endif
+	}
+	return got;
+}
+
+
+
+/* Compress a send on stream n into pack_buf, unless it's small or the
+ * stream has lately turned out not to compress: every miss doubles
+ * how many sends go out as they are before trying again.  Returns the
+ * packed size, or 0 to send it as it is.
+ */
+static int pack_chunk(const int n, const char *buf, const int len)
+{
+	int packed;
+
+	if (len < PACK_MIN || pack_skip[n])
+	{
+		if (pack_skip[n]) pack_skip[n]--;
+		stat_pack_skipped += len;
+		return 0;
+	}
+
+	packed = pack(stream_codec[n], buf, len, pack_buf);
+
+	/* saving less than an eighth isn't worth the CPU */
+	if (packed == 0 || packed > len - len / 8)
+	{
+		if (pack_misses[n] < PACK_BACKOFF) pack_misses[n]++;
+		pack_skip[n] = (unsigned char)((1 << pack_misses[n]) - 1);
+		if (packed == 0) stat_pack_skipped += len;
+	}
+	else
+		pack_misses[n] = 0;
+
+	if (packed)
+	{
+		stat_pack_in += len;
+		stat_pack_out += packed;
+	}
+	return packed;
+}
+
+
+
+/*
+ * The server side finds streams by (peer, id) in an open-addressed
+ * hash of slot+1, 0 being empty.  Ids are only unique per client
+ * portfwd, but a striped stream's frames can come over any of its
+ * links.
+ */
+static int hash_home(const unsigned int peer, const unsigned int id)
+{
+	unsigned int h = (id ^ peer) * 2654435761U;
+
+	return (int)(h >> (32 - hash_bits));
+}
+
+
+
+#define STREAM_PEER(n) (links[stream_link[n]].peer)
+
+/* The slot carrying stream id from whoever is on link l, or -1. */
+static int find_stream(const int l, const unsigned int id)
+{
+	int mask = (1 << hash_bits) - 1, i, n;
+
+	if (tunnel == TUNNEL_CLIENT)
+	{
+		n = (int)(id & (MAX_SLOTS - 1));
+		if (n < max_connections && valid_socket(n) &&
+		    stream_link[n] >= 0 && stream_id[n] == id)
+			return n;
+		return -1;
+	}
+
+	for (i = hash_home(links[l].peer, id); stream_hash[i];
+	     i = (i + 1) & mask)
+	{
+		n = stream_hash[i] - 1;
+		if (stream_id[n] == id && STREAM_PEER(n) == links[l].peer)
+			return n;
+	}
+	return -1;
+}
+
+
+
+static void hash_insert(const int n)
+{
+	int mask = (1 << hash_bits) - 1, i;
+
+	for (i = hash_home(STREAM_PEER(n), stream_id[n]); stream_hash[i];
+	     i = (i + 1) & mask)
+		;
+	stream_hash[i] = n + 1;
+}
+
+
+
+/* Remove slot n, moving later entries up so lookups never need to skip
+ * over holes. */
+static void hash_remove(const int n)
+{
+	int mask = (1 << hash_bits) - 1, i, j, k;
+
+	for (i = hash_home(STREAM_PEER(n), stream_id[n]);
+	     stream_hash[i] != n + 1; i = (i + 1) & mask)
+		if (!stream_hash[i]) return;
+
+	for (j = i;;)
+	{
+		stream_hash[i] = 0;
+		for (;;)
+		{
+			j = (j + 1) & mask;
+			if (!stream_hash[j]) return;
+			k = hash_home(STREAM_PEER(stream_hash[j] - 1),
+				stream_id[stream_hash[j] - 1]);
+			/* it can move up unless its home is in (i, j] */
+			if ((j > i) ? (k <= i || k > j) : (k <= i && k > j))
+				break;
+		}
+		stream_hash[i] = stream_hash[j];
+		i = j;
+	}
+}
+
+
+
+/* Detach slot n from its link, telling the other side if it doesn't
+ * know yet. */
+static void unlink_stream(const int n, const int send_close)
+{
+	int l = stream_link[n];
+	struct held *h;
+
+	if (l < 0) return;
+	if (send_close)
+	{
+		char end[4];
+
+		/* striped: how many frames to wait for */
+		put32(end, stream_tx_seq[n]);
+		link_write(l, FRAME_CLOSE, stream_id[n], end,
+			(stream_flags[n] & STREAM_STRIPED) ? 4 : 0);
+	}
+	while ((h = held_frames[n]) != NULL)
+	{
+		held_frames[n] = h->next;
+		free(h);
+	}
+	stream_held[n] = 0;
+	if (tunnel == TUNNEL_SERVER) hash_remove(n);
+	links[l].streams--;
+	stream_link[n] = -1;
+}
+
+
+
+/* The other side has passed on sent bytes of stream n: hand back credit
+ * once it's worth a frame. */
+static void stream_consumed(const int n, const int sent)
+{
+	char credit[4];
+
+	stream_owed[n] += sent;
+	if (stream_link[n] < 0 || stream_owed[n] < STREAM_WINDOW / 4)
+		return;
+
+	put32(credit, (unsigned int)stream_owed[n]);
+	link_write(stream_link[n], FRAME_WINDOW, stream_id[n], credit, 4);
+	stream_owed[n] = 0;
+}
+
+
+
+/* Start carrying a new client over the least busy link.  Its data can
+ * follow the OPEN straight away: no round trip before the first byte.
+ */
+static void start_stream(const SOCKET incoming)
+{
+	int i, l = -1, curr;
+	char open[2];
+
+	for (i=0; i<num_links; i++)
+		if (links[i].s != INVALID_SOCKET && !links[i].connecting &&
+		    (l < 0 || links[i].streams < links[l].streams))
+			l = i;
+
+	if (l < 0
+#if !defined(USE_EPOLL) && !defined(_WIN32)
+	    || incoming >= FD_SETSIZE
+#endif
+	    )
+	{
+		if (verbose) printf("No link to carry the client.\n");
+		reset_socket(incoming);
+		stat_connect_failed++;
+		return;
+	}
+
+	active_connections++;
+	curr = free_slot();
+
+	/* bump the generation kept in the top byte */
+	stream_id[curr] = ((stream_id[curr] + (1U << 24)) & 0xFF000000U) |
+		(unsigned int)curr;
+	stream_link[curr] = l;
+	stream_credit[curr] = STREAM_WINDOW;
+	stream_owed[curr] = 0;
+	stream_codec[curr] = CODEC_NONE;
+	stream_flags[curr] = use_stripes ? STREAM_STRIPED : 0;
+	stream_tx_seq[curr] = stream_rx_seq[curr] = 0;
+	pack_skip[curr] = pack_misses[curr] = 0;
+	links[l].streams++;
+	stat_streams++;
+
+	/* compress if the far side said it could take it */
+	if ((links[l].codecs >> compress_codec) & 1)
+		stream_codec[curr] = (unsigned char)compress_codec;
+
+	/* the OPEN's payload is the codec, then flags; both optional */
+	open[0] = (char)stream_codec[curr];
+	open[1] = (char)stream_flags[curr];
+	link_write(l, FRAME_OPEN, stream_id[curr], open,
+		stream_flags[curr] ? 2 : (stream_codec[curr] != CODEC_NONE));
+	install_connection(curr, incoming, TUNNEL_SOCKET);
+	if (verbose) printf("connection %d: stream %08x on link %d\n",
+		curr, stream_id[curr], l);
+}
+
+
+
+/* A PROXY protocol v2 header in buf, telling the server where the
+ * client on s comes from and what it connected to.  Returns its length.
+ */
+static int proxy_header(const SOCKET s, char *buf)
+{
+	static const char sig[12] = "\r\n\r\n\0\r\nQUIT\n";
+	struct sockaddr_in from, to;
+	socklen_t from_len = sizeof(from), to_len = sizeof(to);
+
+	memcpy(buf, sig, 12);
+	if (getpeername(s, (struct sockaddr *)&from, &from_len) < 0 ||
+	    getsockname(s, (struct sockaddr *)&to, &to_len) < 0 ||
+	    from.sin_family != AF_INET)
+	{
+		/* LOCAL: the server uses the connection's own addresses */
+		buf[12] = 0x20;
+		buf[13] = buf[14] = buf[15] = 0;
+		return 16;
+	}
+
+	buf[12] = 0x21;			/* version 2, PROXY */
+	buf[13] = 0x11;			/* TCP over IPv4 */
+	buf[14] = 0;
+	buf[15] = 12;
+	memcpy(buf + 16, &from.sin_addr, 4);
+	memcpy(buf + 20, &to.sin_addr, 4);
+	memcpy(buf + 24, &from.sin_port, 2);
+	memcpy(buf + 26, &to.sin_port, 2);
+	return PROXY_HDR_MAX;
+}
+
+
+
+/* Splice a client onto an idle pooled connection, claiming it. */
+static void splice_pooled(const SOCKET incoming)
+{
+	char claim[1 + PROXY_HDR_MAX];
+	int len = 1;
+	SOCKET outgoing;
+
+#if !defined(USE_EPOLL) && !defined(_WIN32)
+	if (incoming >= FD_SETSIZE)
+	{
+		reset_socket(incoming);
+		pause_accepting();
+		return;
+	}
+#endif
+
+	/* the backend passes the PROXY header on with the client's data */
+	claim[0] = POOL_MARKER;
+	if (proxy_protocol) len += proxy_header(incoming, claim + 1);
+
+	/* some may have died since we last looked */
+	while (pool_count)
+	{
+		outgoing = pool_take(pool_count - 1);
+		if (send(outgoing, claim, len, MSG_DONTWAIT) == len)
+		{
+			active_connections++;
+			install_connection(free_slot(), incoming, outgoing);
+			stat_pool_claimed++;
+			return;
+		}
+		closesocket(outgoing);
+		stat_pool_died++;
+	}
+
+	if (verbose) printf("No pooled connection for the client.\n");
+	reset_socket(incoming);
+	stat_connect_failed++;
+}
+
+
+
+/* Give back the buffer start_connection() took early data into. */
+static void drop_early(const int curr)
+{
+	if (backlog_out[curr] == NULL) return;
+	free_buffer(backlog_out[curr], 0);
+	backlog_out[curr] = NULL;
+	buffers_in_use--;
+}
+
+
+
+/* Pair a freshly accepted client with a connection to the server, or
+ * the one for route.
+ * TODO - make outgoing connection before accepting incoming one
+ */
+static void start_connection(const SOCKET incoming, const int route)
+{
+	struct sockaddr_in addrout;
+	int curr, early=0, hdr=0, sent=-1;
+	SOCKET outgoing;
+
+	if (tunnel == TUNNEL_CLIENT)
+	{
+		start_stream(incoming);
+		return;
+	}
+	if (reverse == REVERSE_PUBLIC)
+	{
+		splice_pooled(incoming);
+		return;
+	}
+
+	active_connections++;
+	curr = free_slot();
+
+	/* create the outgoing socket */
+	outgoing = socket(AF_INET, SOCK_STREAM, 0);
+	if (outgoing < 0)
+	{
+		if (errno != EMFILE && errno != ENFILE &&
+		    errno != ENOBUFS && errno != ENOMEM)
+			ERR("problem creating outgoing socket");
+		reset_socket(incoming);
+		active_connections--;
+		pause_accepting();
+		return;
+	}
+
+#if !defined(USE_EPOLL) && !defined(_WIN32)
+	/* select() can't watch these */
+	if (incoming >= FD_SETSIZE || outgoing >= FD_SETSIZE)
+	{
+		reset_socket(incoming);
+		closesocket(outgoing);
+		active_connections--;
+		pause_accepting();
+		return;
+	}
+#endif
+
+	target_address(&addrout, route);
+
+	if (bind_outgoing(outgoing) < 0)
+	{
+		connect_failed(incoming, outgoing);
+		return;
+	}
+
+	/* don't hold up everyone else while the server answers; anything
+	 * that doesn't fit in the SYN waits in the backlog until
+	 * finish_connect() has seen the connect through */
+	set_nonblocking(outgoing);
+
+	/* Whatever the client has already sent (with TCP_DEFER_ACCEPT or
+	 * -route, usually its whole first request) goes out behind the
+	 * PROXY header in the same send, or in our SYN with fast open.
+	 */
+	if ((fastopen_qlen || proxy_protocol) &&
+	    (backlog_out[curr] = alloc_buffer(0)) != NULL)
+	{
+		buffers_in_use++;
+		backlog_out_class[curr] = 0;
+		if (proxy_protocol)
+			hdr = proxy_header(incoming, backlog_out[curr]);
+		early = (int)recv(incoming, backlog_out[curr] + hdr,
+			class_size[0] - hdr, MSG_DONTWAIT);
+		if (early == 0)
+		{
+			if (verbose) printf("Client left before sending.\n");
+			drop_early(curr);
+			closesocket(incoming);
+			closesocket(outgoing);
+			active_connections--;
+			return;
+		}
+		if (early < 0) early = 0;
+		early += hdr;
+		if (!early) drop_early(curr);
+	}
+	else if (proxy_protocol)
+		ERR("Can't allocate a buffer for the PROXY header.");
+
+#ifdef MSG_FASTOPEN
+	if (early && fastopen_qlen)
+	{
+		sent = (int)sendto(outgoing, backlog_out[curr], early,
+			MSG_FASTOPEN, (struct sockaddr *)&addrout,
+			sizeof(struct sockaddr));
+		/* no cookie yet: the SYN went without the data */
+		if (sent < 0 && (errno == EINPROGRESS || errno == EWOULDBLOCK))
+			sent = 0;
+		else if (sent < 0 && errno != EOPNOTSUPP)
+		{
+			drop_early(curr);
+			connect_failed(incoming, outgoing);
+			return;
+		}
+		if (verbose && sent >= 0)
+			printf("Fast open sent %d of %d early bytes\n",
+				sent, early);
+	}
+#endif
+
+	/* connect to the remote server */
+	if (sent < 0 && connect(outgoing, (struct sockaddr *)&addrout,
+				sizeof(struct sockaddr)) < 0 &&
+	    errno != EINPROGRESS && errno != EWOULDBLOCK)
+	{
+		drop_early(curr);
+		connect_failed(incoming, outgoing);
+		return;
+	}
+
+	/* the rest of the early data is backlog */
+	if (sent < 0) sent = 0;
+	backlog_out_pos[curr] = sent;
+	backlog_out_size[curr] = early - sent;
+	if (early && early == sent) drop_early(curr);
+
+#ifdef HAVE_ZEROCOPY
+	if (zerocopy_min)
+	{
+		int one = 1;
+
+		if (setsockopt(incoming, SOL_SOCKET, SO_ZEROCOPY,
+				(char*)&one, sizeof(one)) < 0 ||
+		    setsockopt(outgoing, SOL_SOCKET, SO_ZEROCOPY,
+				(char*)&one, sizeof(one)) < 0)
+		{
+			/* without SO_ZEROCOPY, MSG_ZEROCOPY is silently
+			 * ignored and completions would never arrive */
+			printf("SO_ZEROCOPY not supported, disabling.\n");
+			zerocopy_min = 0;
+		}
+	}
+#endif
+
+	install_connection(curr, incoming, outgoing);
+	conn_ready[curr] = (conn_ready[curr] & ~WR_OUT) | CONNECTING;
+
+	/* the client probably has more if we took some early */
+	if (early > hdr) conn_ready[curr] |= RD_IN;
+}
+
+
+
+/* The far side of a tunnel: connect to the server for a new stream. */
+static void open_stream(const int l, const unsigned int id, const int codec,
+	const int flags)
+{
+	struct sockaddr_in addrout;
+	int curr;
+	SOCKET outgoing;
+
+	if (active_connections >= max_connections)
+	{
+		link_write(l, FRAME_CLOSE, id, NULL, 0);
+		stat_overload_reset++;
+		return;
+	}
+
+	outgoing = socket(AF_INET, SOCK_STREAM, 0);
+	if (outgoing < 0
+#if !defined(USE_EPOLL) && !defined(_WIN32)
+	    || outgoing >= FD_SETSIZE
+#endif
+	    )
+	{
+		if (outgoing >= 0) closesocket(outgoing);
+		link_write(l, FRAME_CLOSE, id, NULL, 0);
+		pause_accepting();
+		return;
+	}
+
+	/* don't hold up the other streams while it connects; the client's
+	 * data waits in the backlog, and finish_connect() sees it through */
+	active_connections++;
+	set_nonblocking(outgoing);
+	target_address(&addrout, -1);
+	if (bind_outgoing(outgoing) < 0 ||
+	    (connect(outgoing, (struct sockaddr *)&addrout,
+			sizeof(struct sockaddr)) < 0 &&
+	     errno != EINPROGRESS && errno != EWOULDBLOCK))
+	{
+		connect_failed(TUNNEL_SOCKET, outgoing);
+		link_write(l, FRAME_CLOSE, id, NULL, 0);
+		return;
+	}
+
+	curr = free_slot();
+	stream_id[curr] = id;
+	stream_link[curr] = l;
+	stream_credit[curr] = STREAM_WINDOW;
+	stream_owed[curr] = 0;
+	stream_codec[curr] = (unsigned char)codec;
+	stream_flags[curr] = (unsigned char)(flags | STREAM_ACKED);
+	stream_tx_seq[curr] = stream_rx_seq[curr] = 0;
+	pack_skip[curr] = pack_misses[curr] = 0;
+	links[l].streams++;
+	stat_streams++;
+	hash_insert(curr);
+
+	/* let a striping client loose on the other links */
+	if (flags & STREAM_STRIPED)
+	{
+		char none[4];
+
+		put32(none, 0);
+		link_write(l, FRAME_WINDOW, id, none, 4);
+	}
+
+	install_connection(curr, TUNNEL_SOCKET, outgoing);
+	conn_ready[curr] = (conn_ready[curr] & ~WR_OUT) | CONNECTING;
+	if (verbose) printf("connection %d: stream %08x on link %d\n",
+		curr, id, l);
+}
+
+
+
+/* The backend side of a pool: entry i is being claimed by a client, or
+ * has been closed. */
+static void claim_pooled(const int i)
+{
+	struct sockaddr_in addrout;
+	SOCKET incoming, outgoing;
+	char marker;
+	int got, curr;
+
+	got = (int)recv(pool[i], &marker, 1, MSG_DONTWAIT);
+	if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		pool_ready[i] = 0;
+		return;
+	}
+
+	incoming = pool_take(i);
+	if (got != 1 || marker != POOL_MARKER)
+	{
+		/* the public side went away, or we never got through */
+		closesocket(incoming);
+		stat_pool_died++;
+		pool_retry = now + LINK_RETRY_MS;
+		return;
+	}
+
+	if (active_connections >= max_connections)
+	{
+		reset_socket(incoming);
+		stat_overload_reset++;
+		return;
+	}
+
+	outgoing = socket(AF_INET, SOCK_STREAM, 0);
+	if (outgoing < 0
+#if !defined(USE_EPOLL) && !defined(_WIN32)
+	    || outgoing >= FD_SETSIZE
+#endif
+	    )
+	{
+		if (outgoing >= 0) closesocket(outgoing);
+		reset_socket(incoming);
+		pause_accepting();
+		return;
+	}
+
+	/* the client's first bytes can wait in its socket until
+	 * finish_connect() has seen the connect through */
+	active_connections++;
+	set_nonblocking(outgoing);
+	target_address(&addrout, -1);
+	if (bind_outgoing(outgoing) < 0 ||
+	    (connect(outgoing, (struct sockaddr *)&addrout,
+			sizeof(struct sockaddr)) < 0 &&
+	     errno != EINPROGRESS && errno != EWOULDBLOCK))
+	{
+		connect_failed(incoming, outgoing);
+		return;
+	}
+
+	curr = free_slot();
+	install_connection(curr, incoming, outgoing);
+	stat_pool_claimed++;
+
+	/* the client's first bytes may be right behind the marker */
+	conn_ready[curr] = (conn_ready[curr] & ~WR_OUT) | RD_IN | CONNECTING;
+	if (verbose) printf("connection %d: claimed from the pool\n", curr);
+}
+
+
+
+/* Non-zero if the backlog buffer can't be received into yet. */
+static int backlog_busy(const int n, const direction dir)
+{
+	int *backlog_size = (dir==IN)?backlog_in_size:backlog_out_size;
+#ifdef HAVE_ZEROCOPY
+	int *pending      = (dir==IN)?zc_in_pending  :zc_out_pending;
+
+	if (pending[n]) return 1;
+#endif
+	return backlog_size[n];
+}
+
+
+
+/* How much bounce() is holding back for dir. */
+static int corked(const int n, const direction dir)
+{
+	int *held = (dir==IN)?corked_in:corked_out;
+
+	return coalesce_min ? held[n] : 0;
+}
+
+
+
+/* Once nothing is in flight, the buffer goes back to the pool, so an
+ * idle connection holds no buffers at all.
+ */
+static void release_buffer(const int n, const direction dir)
+{
+	char **backlog     = (dir==IN)?backlog_in      :backlog_out;
+	unsigned char *cls = (dir==IN)?backlog_in_class:backlog_out_class;
+
+	if (backlog[n] == NULL || backlog_busy(n, dir) || corked(n, dir))
+		return;
+
+	free_buffer(backlog[n], cls[n]);
+	backlog[n] = NULL;
+	buffers_in_use--;
+}
+
+
+
+#ifdef HAVE_ZEROCOPY
+/* Pick up MSG_ZEROCOPY completions from the socket's error queue.  Until
+ * every zerocopy send on it has completed, the backlog buffer for that
+ * direction belongs to the kernel.
+ */
+static void reap_zerocopy(const int n, const direction dir)
+{
+	SOCKET *conn = (dir==IN)?conn_in      :conn_out;
+	int *pending = (dir==IN)?zc_in_pending:zc_out_pending;
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+
+	while (pending[n] > 0)
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(conn[n], &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return;
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if (!(cm->cmsg_level == SOL_IP &&
+			      cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 &&
+			      cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			/* [ee_info, ee_data] is an inclusive range */
+			pending[n] -= (int)(serr->ee_data - serr->ee_info + 1);
+			if (pending[n] < 0) pending[n] = 0;
+
+			if (verbose) printf("connection %d: zerocopy "
+				"completed %u-%u%s, %d pending\n", n,
+				serr->ee_info, serr->ee_data,
+				(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) ?
+				" (copied)" : "", pending[n]);
+		}
+	}
+	release_buffer(n, dir);
+}
+#endif
+
+
+
+#ifdef HAVE_SOCKMAP
+/*
+ * In-kernel forwarding.  Both sockets of a connection go into a sockmap
+ * at keys slot*2 (in) and slot*2 + 1 (out), and an sk_skb verdict
+ * program redirects whatever arrives on one straight out of the other.
+ * The program finds the peer's key by the socket's cookie, in a hash
+ * that also counts the bytes it moved.
+ */
+static int sockmap_fd = -1,
+	   peers_fd = -1;
+
+/* value in peers_fd, keyed by socket cookie */
+struct sockmap_peer {
+	__u32 key;	/* the other socket's key in sockmap_fd */
+	__u32 pad;
+	__u64 bytes;	/* redirected from this socket so far */
+};
+
+#define INSN(code, dst, src, off, imm) { (code), (dst), (src), (off), (imm) }
+
+/* The whole skb is one message. */
+static struct bpf_insn parser_prog[] = {
+	/* r0 = skb->len */
+	INSN(BPF_LDX|BPF_MEM|BPF_W, 0, 1, offsetof(struct __sk_buff, len), 0),
+	INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0)
+};
+
+#define VERDICT_PEERS 3		/* instructions that load map fds */
+#define VERDICT_SOCKMAP 13
+static struct bpf_insn verdict_prog[] = {
+	/* look up this socket's peer */
+	INSN(BPF_ALU64|BPF_MOV|BPF_X, 6, 1, 0, 0),
+	INSN(BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+	INSN(BPF_STX|BPF_MEM|BPF_DW, 10, 0, -8, 0),
+	INSN(BPF_LD|BPF_DW|BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, 0),
+	INSN(0, 0, 0, 0, 0),
+	INSN(BPF_ALU64|BPF_MOV|BPF_X, 2, 10, 0, 0),
+	INSN(BPF_ALU64|BPF_ADD|BPF_K, 2, 0, 0, -8),
+	INSN(BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+	INSN(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, 9, 0),
+
+	/* count it, then send it out of the peer */
+	INSN(BPF_LDX|BPF_MEM|BPF_W, 1, 6, offsetof(struct __sk_buff, len), 0),
+	INSN(BPF_STX|BPF_XADD|BPF_DW, 0, 1,
+		offsetof(struct sockmap_peer, bytes), 0),
+	INSN(BPF_LDX|BPF_MEM|BPF_W, 3, 0, offsetof(struct sockmap_peer, key),
+		0),
+	INSN(BPF_ALU64|BPF_MOV|BPF_X, 1, 6, 0, 0),
+	INSN(BPF_LD|BPF_DW|BPF_IMM, 2, BPF_PSEUDO_MAP_FD, 0, 0),
+	INSN(0, 0, 0, 0, 0),
+	INSN(BPF_ALU64|BPF_MOV|BPF_K, 4, 0, 0, 0),
+	INSN(BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_map),
+	INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0),
+
+	/* not ours: leave it for recv() */
+	INSN(BPF_ALU64|BPF_MOV|BPF_K, 0, 0, 0, SK_PASS),
+	INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0)
+};
+
+#undef INSN
+
+
+
+static int sys_bpf(const int cmd, union bpf_attr *attr)
+{
+	return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+
+static int create_map(const int type, const int key_size,
+	const int value_size, const int entries, const int flags)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = type;
+	attr.key_size = key_size;
+	attr.value_size = value_size;
+	attr.max_entries = entries;
+	attr.map_flags = flags;
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+
+
+static int load_prog(struct bpf_insn *insns, const int count)
+{
+	union bpf_attr attr;
+	static char log[4096];
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+	attr.insns = (__u64)(unsigned long)insns;
+	attr.insn_cnt = count;
+	attr.license = (__u64)(unsigned long)"GPL";
+	if (verbose)
+	{
+		/* the kernel refuses a log buffer at log level 0 */
+		attr.log_buf = (__u64)(unsigned long)log;
+		attr.log_size = sizeof(log);
+		attr.log_level = 1;
+	}
+
+	fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (fd < 0 && verbose) printf("verifier says:\n%s\n", log);
+	return fd;
+}
+
+
+
+static int attach_prog(const int prog, const int type)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.target_fd = sockmap_fd;
+	attr.attach_bpf_fd = prog;
+	attr.attach_type = type;
+	return sys_bpf(BPF_PROG_ATTACH, &attr);
+}
+
+
+
+static int map_update(const int map, const void *key, const void *value)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map;
+	attr.key = (__u64)(unsigned long)key;
+	attr.value = (__u64)(unsigned long)value;
+	attr.flags = BPF_ANY;
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+
+
+static int map_lookup(const int map, const void *key, void *value)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map;
+	attr.key = (__u64)(unsigned long)key;
+	attr.value = (__u64)(unsigned long)value;
+	return sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+
+
+static void map_delete(const int map, const void *key)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map;
+	attr.key = (__u64)(unsigned long)key;
+	(void) sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+
+
+/* Set up the maps and programs.  Returns non-zero on success; needs
+ * root (or CAP_BPF and CAP_NET_ADMIN).
+ */
+static int init_sockmap(void)
+{
+	int parser, verdict;
+
+	sockmap_fd = create_map(BPF_MAP_TYPE_SOCKMAP, sizeof(__u32),
+		sizeof(__u32), max_connections * 2, 0);
+	peers_fd = create_map(BPF_MAP_TYPE_HASH, sizeof(__u64),
+		sizeof(struct sockmap_peer), max_connections * 2,
+		BPF_F_NO_PREALLOC);
+	if (sockmap_fd < 0 || peers_fd < 0)
+	{
+		printf("Can't create BPF maps: %s\n", strerror(errno));
+		return 0;
+	}
+
+	verdict_prog[VERDICT_PEERS].imm = peers_fd;
+	verdict_prog[VERDICT_SOCKMAP].imm = sockmap_fd;
+
+	parser = load_prog(parser_prog,
+		sizeof(parser_prog) / sizeof(parser_prog[0]));
+	verdict = load_prog(verdict_prog,
+		sizeof(verdict_prog) / sizeof(verdict_prog[0]));
+	if (parser < 0 || verdict < 0)
+	{
+		printf("Can't load BPF programs: %s\n", strerror(errno));
+		return 0;
+	}
+
+	if (attach_prog(parser, BPF_SK_SKB_STREAM_PARSER) < 0 ||
+	    attach_prog(verdict, BPF_SK_SKB_STREAM_VERDICT) < 0)
+	{
+		printf("Can't attach BPF programs: %s\n", strerror(errno));
+		return 0;
+	}
+
+	/* the sockmap holds references to them now */
+	close(parser);
+	close(verdict);
+	return 1;
+}
+
+
+
+static __u64 socket_cookie(const SOCKET s)
+{
+	__u64 cookie = 0;
+	socklen_t len = sizeof(cookie);
+
+	(void) getsockopt(s, SOL_SOCKET, SO_COOKIE, &cookie, &len);
+	return cookie;
+}
+
+
+
+/* Take both sockets out of the maps, adding up what the kernel moved. */
+static void sockmap_remove(const int n)
+{
+	struct sockmap_peer peer;
+	__u64 cookie;
+	__u32 key;
+
+	key = (__u32)n * 2;
+	map_delete(sockmap_fd, &key);
+	key++;
+	map_delete(sockmap_fd, &key);
+
+	cookie = socket_cookie(conn_in[n]);
+	if (map_lookup(peers_fd, &cookie, &peer) == 0)
+	{
+		stat_kernel_bytes += (unsigned long)peer.bytes;
+		if (usage != NULL) unfolded_out[n] += (unsigned long)peer.bytes;
+	}
+	map_delete(peers_fd, &cookie);
+
+	cookie = socket_cookie(conn_out[n]);
+	if (map_lookup(peers_fd, &cookie, &peer) == 0)
+	{
+		stat_kernel_bytes += (unsigned long)peer.bytes;
+		if (usage != NULL) unfolded_in[n] += (unsigned long)peer.bytes;
+	}
+	map_delete(peers_fd, &cookie);
+}
+
+
+
+/* The connection is closing: forget how it was forwarded. */
+static void sockmap_unload(const int n)
+{
+	if (sockmap_state[n] == SOCKMAP_DRAINING) num_draining--;
+	if (sockmap_state[n] == SOCKMAP_KERNEL ||
+	    sockmap_state[n] == SOCKMAP_DRAINING)
+		sockmap_remove(n);
+	sockmap_state[n] = SOCKMAP_USERSPACE;
+}
+
+
+
+/* Whether the handshake is over; a fast open connect() returns early. */
+static int established(const SOCKET s)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	if (getsockopt(s, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+		return 0;
+	return info.tcpi_state == TCP_ESTABLISHED;
+}
+
+
+
+/* Hand a quiet connection over to the kernel.  Only done with nothing
+ * in flight in userspace, so nothing we still hold can be overtaken,
+ * and with both sockets read until EAGAIN: the stream parser misreads
+ * an skb that recv() has already taken part of.
+ */
+static void sockmap_offload(const int n)
+{
+	struct sockmap_peer peer;
+	__u64 cookie_in, cookie_out;
+	__u32 key;
+	int fd, lowat = 1;
+
+	if (!established(conn_out[n])) return;
+
+	cookie_in = socket_cookie(conn_in[n]);
+	cookie_out = socket_cookie(conn_out[n]);
+	memset(&peer, 0, sizeof(peer));
+
+	peer.key = (__u32)n * 2 + 1;
+	if (cookie_in == 0 || map_update(peers_fd, &cookie_in, &peer) < 0)
+		goto failed;
+	peer.key = (__u32)n * 2;
+	if (cookie_out == 0 || map_update(peers_fd, &cookie_out, &peer) < 0)
+		goto failed;
+
+	key = (__u32)n * 2;
+	fd = conn_in[n];
+	if (map_update(sockmap_fd, &key, &fd) < 0) goto failed;
+	key++;
+	fd = conn_out[n];
+	if (map_update(sockmap_fd, &key, &fd) < 0) goto failed;
+
+	sockmap_state[n] = SOCKMAP_KERNEL;
+	stat_offloaded++;
+	if (verbose) printf("connection %d: forwarding in the kernel\n", n);
+
+	/* Anything that arrived since we last read is sitting in the
+	 * receive queue, where the parser only looks on the next arrival.
+	 * Setting SO_RCVLOWAT makes TCP signal it now.
+	 */
+	(void) setsockopt(conn_in[n], SOL_SOCKET, SO_RCVLOWAT,
+		(char*)&lowat, sizeof(lowat));
+	(void) setsockopt(conn_out[n], SOL_SOCKET, SO_RCVLOWAT,
+		(char*)&lowat, sizeof(lowat));
+	return;
+
+failed:
+	if (verbose) printf("connection %d: can't use sockmap: %s\n",
+		n, strerror(errno));
+	sockmap_remove(n);
+	sockmap_state[n] = SOCKMAP_PINNED;
+	stat_offload_failed++;
+}
+
+
+
+/* One side of an offloaded connection hit EOF.  What the kernel already
+ * redirected to the other may be queued behind a full socket buffer,
+ * and would be lost by closing it now.  Returns non-zero if the
+ * connection is left to drain rather than being closed.
+ */
+static int sockmap_eof(const int n, const direction dir)
+{
+	SOCKET dest = (dir==IN)?conn_in[n]:conn_out[n];
+
+	conn_ready[n] &= (dir==IN) ? ~RD_OUT : ~RD_IN;
+	if (sockmap_state[n] == SOCKMAP_DRAINING) return 1;
+	if (sockmap_state[n] != SOCKMAP_KERNEL || unsent(dest) == 0)
+		return 0;
+
+	if (verbose) printf("connection %d: draining before close\n", n);
+	sockmap_state[n] = SOCKMAP_DRAINING;
+	last_active[n] = now;
+	num_draining++;
+	return 1;
+}
+#endif /* HAVE_SOCKMAP */
+
+
+
+#ifdef HAVE_SPILL
+/* Whether dir has data waiting in a spill file. */
+static int spilled(const int n, const direction dir)
+{
+	int *fd = (dir==IN)?spill_in_fd:spill_out_fd;
+
+	return spill_dir != NULL && fd[n] >= 0;
+}
+
+
+
+/* Whether what the sender sends for dir can go in the spill file. */
+static int can_spill(const int n, const direction dir)
+{
+	int *fd    = (dir==IN)?spill_in_fd :spill_out_fd;
+	off_t *end = (dir==IN)?spill_in_end:spill_out_end;
+	off_t *pos = (dir==IN)?spill_in_pos:spill_out_pos;
+
+	if (spill_dir == NULL || tunnel != TUNNEL_NONE ||
+	    (conn_ready[n] & ((dir==IN) ? EOF_OUT : EOF_IN)) ||
+	    (spill_flags[n] & (SPILL_FAILED << dir)))
+		return 0;
+	return !spill_max || fd[n] < 0 || end[n] - pos[n] < spill_max;
+}
+
+
+
+static void close_spill(const int n, const direction dir)
+{
+	int *fd    = (dir==IN)?spill_in_fd :spill_out_fd;
+	off_t *end = (dir==IN)?spill_in_end:spill_out_end;
+	off_t *pos = (dir==IN)?spill_in_pos:spill_out_pos;
+
+	if (fd[n] < 0) return;
+	close(fd[n]);
+	fd[n] = -1;
+	end[n] = pos[n] = 0;
+	num_spilling--;
+}
+#endif /* HAVE_SPILL */
+
+
+
+/* Whether everything read for dir has been sent on. */
+static int drained(const int n, const direction dir)
+{
+#ifdef HAVE_SPILL
+	if (spilled(n, dir)) return 0;
+#endif
+	return !backlog_busy(n, dir) && !corked(n, dir);
+}
+
+
+
+static void kill_connection(const int n)
+{
+#ifdef HAVE_SOCKMAP
+	if (use_sockmap) sockmap_unload(n);
+#endif
+	if (tunnel != TUNNEL_NONE) unlink_stream(n, 1);
+	if (usage != NULL && conn_client[n] >= 0)
+	{
+		fold_usage(n);
+		conn_client[n] = -1;
+	}
+	if (conn_in[n] != TUNNEL_SOCKET) closesocket(conn_in[n]);
+	if (conn_out[n] != TUNNEL_SOCKET) closesocket(conn_out[n]);
+#ifdef HAVE_SPILL
+	if (spill_dir != NULL)
+	{
+		close_spill(n, IN);
+		close_spill(n, OUT);
+		spill_flags[n] = 0;
+	}
+#endif
+	backlog_in_size[n] = backlog_out_size[n] =
+		backlog_in_pos[n] = backlog_out_pos[n] = 0;
+	read_in_avg[n] = read_out_avg[n] = 0;
+	if (coalesce_min) corked_in[n] = corked_out[n] = 0;
+
+#ifdef HAVE_ZEROCOPY
+	/* The kernel may still be transmitting from a buffer it hasn't
+	 * released yet.  Let it keep those pages and use fresh ones.
+	 */
+	if (zc_in_pending[n])
+	{
+		retire_buffer(backlog_in[n], backlog_in_class[n]);
+		backlog_in[n] = NULL;
+		buffers_in_use--;
+	}
+	if (zc_out_pending[n])
+	{
+		retire_buffer(backlog_out[n], backlog_out_class[n]);
+		backlog_out[n] = NULL;
+		buffers_in_use--;
+	}
+	zc_in_pending[n] = zc_out_pending[n] = 0;
+#endif
+
+	release_buffer(n, IN);
+	release_buffer(n, OUT);
+	backlog_in_class[n] = backlog_out_class[n] = 0;
+
+	conn_in[n] = INVALID_SOCKET;
+	conn_out[n] = INVALID_SOCKET;
+	swap_slots(n, slot_list[--slots_used]);
+
+	active_connections--;
+	if (verbose)
+		printf("Connection %d closed. active=%d\n", n,
+			active_connections);
+}
+
+
+
+/* Whether n's server side has connected, once its socket says
+ * something.  If the connect failed, the connection is closed, which
+ * for a tunnel stream tells the client.
+ */
+static int finish_connect(const int n)
+{
+	int err = 0;
+	socklen_t len = (socklen_t)sizeof(err);
+
+	if (!(conn_ready[n] & (RD_OUT | WR_OUT))) return 0;
+
+	if (getsockopt(conn_out[n], SOL_SOCKET, SO_ERROR, (char*)&err,
+			&len) < 0)
+		err = errno;
+	if (err == 0)
+	{
+		if (!(conn_ready[n] & WR_OUT)) return 0;
+		conn_ready[n] &= ~CONNECTING;
+		return 1;
+	}
+
+	if (err == EADDRNOTAVAIL || err == EADDRINUSE)
+		stat_ports_exhausted++;
+	else
+		stat_connect_failed++;
+	if (verbose) printf("connection %d: can't connect: %s\n", n,
+		strerror(err));
+	kill_connection(n);
+	return 0;
+}
+
+
+
+/* The last bufsize bytes from offset in the backlog buffer weren't sent. */
+static void add_backlog(const int n, const direction dir,
+	const int offset, const int bufsize)
+{
+	int *backlog_size = (dir==IN)?backlog_in_size:backlog_out_size;
+	int *backlog_pos  = (dir==IN)?backlog_in_pos :backlog_out_pos;
+
+	backlog_pos[n] = offset;
+	backlog_size[n] = bufsize;
+
+	if (verbose)
+		printf("Backlogged %d bytes for connection %d\n",
+			bufsize, n);
+}
+
+
+
+/* Send what's held back for dir as soon as we can: it's the backlog. */
+static void uncork(const int n, const direction dir)
+{
+	int *held = (dir==IN)?corked_in:corked_out;
+
+	add_backlog(n, dir, 0, held[n]);
+	held[n] = 0;
+}
+
+
+
+/* Attach a buffer from the class that best fits want bytes, or swap an
+ * empty one for it.  The class last used is the starting point.
+ */
+static void attach_buffer(const int n, const direction dir, const int want)
+{
+	char **backlog     = (dir==IN)?backlog_in      :backlog_out;
+	unsigned char *cls = (dir==IN)?backlog_in_class:backlog_out_class;
+	char *buf;
+	int c;
+
+	for (c=0; c<NUM_CLASSES-1 && class_size[c] < want; c++)
+		;
+
+	/* only shrink when comfortably under, so we don't flap */
+	if (c < cls[n] && 2 * want > class_size[c])
+		c = cls[n];
+	if (c == cls[n] && backlog[n] != NULL)
+		return;
+
+	buf = alloc_buffer(c);
+	if (buf == NULL)
+	{
+		/* if memory is short, make do with what we have */
+		if (backlog[n] != NULL) return;
+		ERR("Can't allocate a %d byte buffer.", class_size[c]);
+	}
+
+	if (verbose && c != cls[n])
+		printf("connection %d: %s buffer %d -> %d bytes\n",
+			n, (dir==IN) ? "in" : "out", class_size[cls[n]],
+			class_size[c]);
+
+	if (backlog[n] != NULL)
+		free_buffer(backlog[n], cls[n]);
+	else
+		buffers_in_use++;
+	backlog[n] = buf;
+	cls[n] = (unsigned char)c;
+}
+
+
+
+/* DATA for stream n has come off its link: queue it for the socket at
+ * this end, unpacking it first if need be.  Returns -1 if the other
+ * side overran the window or sent garbage.
+ */
+static int tunnel_deliver(const int n, const int packed, const char *data,
+	const int len)
+{
+	direction dir      = (conn_in[n]==TUNNEL_SOCKET)?OUT:IN;
+	char **backlog     = (dir==IN)?backlog_in      :backlog_out;
+	int *backlog_size  = (dir==IN)?backlog_in_size :backlog_out_size;
+	int *backlog_pos   = (dir==IN)?backlog_in_pos  :backlog_out_pos;
+	unsigned char *cls = (dir==IN)?backlog_in_class:backlog_out_class;
+	int size, want, got;
+
+	/* a whole window has to fit, so only the biggest class will do */
+	if (backlog[n] == NULL) attach_buffer(n, dir, STREAM_WINDOW);
+	size = class_size[cls[n]];
+
+	/* a packed frame unpacks to at most BACKLOG_SIZE */
+	want = len;
+	if (packed)
+	{
+		if (stream_codec[n] == CODEC_NONE) return -1;
+		want = size - backlog_size[n];
+		if (want > BACKLOG_SIZE) want = BACKLOG_SIZE;
+	}
+	if (backlog_size[n] + want > size) return -1;
+
+	if (backlog_pos[n] + backlog_size[n] + want > size)
+	{
+		memmove(backlog[n], backlog[n] + backlog_pos[n],
+			backlog_size[n]);
+		backlog_pos[n] = 0;
+	}
+	if (packed)
+	{
+		got = unpack(stream_codec[n], data, len,
+			backlog[n] + backlog_pos[n] + backlog_size[n], want);
+		if (got < 0) return -1;
+	}
+	else
+	{
+		memcpy(backlog[n] + backlog_pos[n] + backlog_size[n],
+			data, len);
+		got = len;
+	}
+	backlog_size[n] += got;
+	last_active[n] = now;
+	return 0;
+}
+
+
+
+/* A striped frame for stream n: pass it on in sequence, holding any
+ * that overtook others on a faster link.  Returns -1 if the other side
+ * overran the window or sent garbage.
+ */
+static int stripe_deliver(const int n, const int packed, const char *data,
+	const int len)
+{
+	struct held *h, **p;
+	unsigned int seq;
+
+	if (len < 4 || !(stream_flags[n] & STREAM_STRIPED)) return -1;
+	seq = get32(data);
+
+	if (seq != stream_rx_seq[n])
+	{
+		/* held frames are within the window like delivered ones */
+		if ((int)(seq - stream_rx_seq[n]) < 0 ||
+		    stream_held[n] + len > STREAM_WINDOW)
+			return -1;
+
+		h = (struct held*)malloc(offsetof(struct held, data) + len);
+		if (h == NULL) ERR("Can't hold a frame.");
+		h->seq = seq;
+		h->packed = packed;
+		h->len = len - 4;
+		memcpy(h->data, data + 4, len - 4);
+
+		for (p = &held_frames[n]; *p != NULL &&
+		     (int)((*p)->seq - stream_rx_seq[n]) <
+			(int)(seq - stream_rx_seq[n]); p = &(*p)->next)
+			;
+		h->next = *p;
+		*p = h;
+		stream_held[n] += h->len;
+		stat_reordered++;
+		return 0;
+	}
+
+	if (tunnel_deliver(n, packed, data + 4, len - 4) < 0) return -1;
+	stream_rx_seq[n]++;
+
+	while ((h = held_frames[n]) != NULL && h->seq == stream_rx_seq[n])
+	{
+		held_frames[n] = h->next;
+		stream_held[n] -= h->len;
+		if (tunnel_deliver(n, h->packed, h->data, h->len) < 0)
+		{
+			free(h);
+			return -1;
+		}
+		free(h);
+		stream_rx_seq[n]++;
+	}
+
+	if ((stream_flags[n] & STREAM_ENDING) &&
+	    stream_rx_seq[n] == stream_end[n])
+		unlink_stream(n, 0);
+	return 0;
+}
+
+
+
+/* Frame as much of buf as stream n has credit and its link has room
+ * for.  Fails with EAGAIN like a full socket would.
+ */
+static int tunnel_send(const int n, const char *buf, const int len)
+{
+	int l = send_link(n), chunk, packed, seq;
+	char *p;
+
+	if (l < 0)
+	{
+		errno = EPIPE;
+		return -1;
+	}
+	if (link_room(l) < len && links[l].writable) flush_link(l);
+
+	/* striped frames lead with a sequence number */
+	seq = (stream_flags[n] & STREAM_STRIPED) ? 4 : 0;
+	chunk = len;
+	if (chunk > stream_credit[n]) chunk = stream_credit[n];
+	if (chunk > link_room(l) - seq)
+	{
+		chunk = link_room(l) - seq;
+		links[l].starved = 1;
+	}
+	if (chunk <= 0)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	packed = (stream_codec[n] != CODEC_NONE) ?
+		pack_chunk(n, buf, chunk) : 0;
+	if (seq)
+	{
+		p = link_frame(l, packed ? FRAME_SPACKED : FRAME_SDATA,
+			stream_id[n], seq + (packed ? packed : chunk));
+		put32(p, stream_tx_seq[n]++);
+		memcpy(p + seq, packed ? pack_buf : buf,
+			packed ? packed : chunk);
+	}
+	else if (packed)
+		link_write(l, FRAME_PACKED, stream_id[n], pack_buf, packed);
+	else
+		link_write(l, FRAME_DATA, stream_id[n], buf, chunk);
+	stream_credit[n] -= chunk;
+	return chunk;
+}
+
+
+
+static int send_data(const int n, const direction dir,
+	const char *buf, const int len)
+{
+	SOCKET *conn = (dir==IN)?conn_in:conn_out;
+#ifdef HAVE_ZEROCOPY
+	int *pending = (dir==IN)?zc_in_pending:zc_out_pending;
+#endif
+	int sent;
+
+	if (conn[n] == TUNNEL_SOCKET) return tunnel_send(n, buf, len);
+
+#ifdef HAVE_ZEROCOPY
+	if (zerocopy_min && len >= zerocopy_min)
+	{
+		sent = (int)send(conn[n], buf, len,
+			MSG_DONTWAIT | MSG_ZEROCOPY);
+		if (sent > 0) pending[n]++;
+
+		/* ENOBUFS: out of optmem for notifications, so copy */
+		if (sent >= 0 || errno != ENOBUFS) return sent;
+	}
+#endif
+	sent = (int)send(conn[n], buf, len, MSG_DONTWAIT);
+
+	/* in a tunnel, whatever reaches a real socket came off a link */
+	if (tunnel != TUNNEL_NONE && sent > 0)
+	{
+		stream_consumed(n, sent);
+		if (window_bytes != NULL) note_traffic(n, sent);
+	}
+	return sent;
+}
+
+
+
+static void flush_backlog(const int n, const direction dir)
+{
+	char **backlog    = (dir==IN)?backlog_in     :backlog_out;
+	int *backlog_size = (dir==IN)?backlog_in_size:backlog_out_size;
+	int *backlog_pos  = (dir==IN)?backlog_in_pos :backlog_out_pos;
+	int sent;
+
+	sent = send_data(n, dir, backlog[n] + backlog_pos[n],
+		backlog_size[n]);
+
+	if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		conn_ready[n] &= (dir==IN) ? ~WR_IN : ~WR_OUT;
+		return;
+	}
+	if (sent < 1)
+	{
+		if (verbose)
+		{
+			printf("send() returned %d. ", sent);
+			if (sent == -1) printf("errno=%d ", errno);
+			printf("\n");
+		}
+		kill_connection(n);
+		return;
+	}
+
+	if (verbose) printf("connection %d: sent %d of %d backlog\n",
+		n, sent, backlog_size[n]);
+	last_active[n] = now;
+
+	backlog_size[n] -= sent;
+
+	if (backlog_size[n] == 0)
+	{
+		backlog_pos[n] = 0;
+		release_buffer(n, dir);
+	}
+	else
+	{
+		/* a short send means the socket buffer is full */
+		backlog_pos[n] += sent;
+		conn_ready[n] &= (dir==IN) ? ~WR_IN : ~WR_OUT;
+	}
+}
+
+
+
+/* Only called when the backlog for dir is empty, so receive straight
+ * into its buffer: whatever can't be sent right away is then already
+ * backlogged, and zerocopy sends have storage that outlives this call.
+ * When coalescing, small reads are received after what's being held
+ * back, and only sent once there's enough.
+ * Returns the number of bytes received.
+ */
+static int bounce(const SOCKET src, const int n, const direction dir,
+	const int limit)
+{
+	char **backlog     = (dir==IN)?backlog_in      :backlog_out;
+	unsigned char *cls = (dir==IN)?backlog_in_class:backlog_out_class;
+	int *avg           = (dir==IN)?read_in_avg     :read_out_avg;
+	int *held          = (dir==IN)?corked_in       :corked_out;
+	unsigned long *since = (dir==IN)?corked_in_since:corked_out_since;
+	char *buf;
+	int recvd, sent, size, want, kept;
+
+	/* pick a buffer size from recent reads, or from what's waiting */
+	want = 2 * avg[n];
+#ifdef FIONREAD
+	if (use_fionread)
+	{
+		u_long avail = 0;
+
+#ifdef _WIN32
+		if (ioctlsocket(src, FIONREAD, &avail) == 0 && avail > 0)
+#else
+		if (ioctl(src, FIONREAD, &avail) == 0 && avail > 0)
+#endif
+			want = (avail < (u_long)limit) ? (int)avail : limit;
+	}
+#endif
+	if (want < coalesce_min) want = coalesce_min;
+	if (want > BACKLOG_SIZE)	/* the window class is for tunnels */
+		want = BACKLOG_SIZE;
+
+	/* the buffer can't be swapped while it's holding something */
+	kept = corked(n, dir);
+	if (!kept) attach_buffer(n, dir, want);
+
+	buf = backlog[n];
+	size = class_size[cls[n]];
+	if (size > kept + limit) size = kept + limit;
+
+	recvd = (int)recv(src, buf + kept, size - kept, MSG_DONTWAIT);
+	if (recvd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		conn_ready[n] &= (dir==IN) ? ~RD_OUT : ~RD_IN;
+		release_buffer(n, dir);
+		return 0;
+	}
+	if (recvd == 0 && kept)
+	{
+		/* the receiver still gets what's held back */
+		conn_ready[n] |= (dir==IN) ? EOF_OUT : EOF_IN;
+		conn_ready[n] &= (dir==IN) ? ~RD_OUT : ~RD_IN;
+		uncork(n, dir);
+		return 0;
+	}
+#ifdef HAVE_SOCKMAP
+	if (recvd == 0 && use_sockmap && sockmap_eof(n, dir))
+	{
+		release_buffer(n, dir);
+		return 0;
+	}
+#endif
+	if (recvd < 1)
+	{
+		if (verbose)
+		{
+			printf("recv() returned %d. ", recvd);
+			if (recvd == -1) printf("errno=%d ", errno);
+			printf("\n");
+		}
+		kill_connection(n);
+		return 0;
+	}
+	last_active[n] = now;
+	avg[n] = (7 * avg[n] + recvd) / 8;
+	if (usage != NULL && conn_client[n] >= 0)
+		charge_usage(n, dir, recvd);
+	if (window_bytes != NULL) note_traffic(n, recvd);
+
+	if (coalesce_min)
+	{
+		/* hold it back unless there's enough, there's no room for
+		 * more, or the oldest of it has waited long enough */
+		if (!kept) since[n] = now_us;
+		held[n] = kept + recvd;
+		if (held[n] < coalesce_min && held[n] < size &&
+		    (long)(now_us - since[n]) < coalesce_us)
+		{
+			if (verbose) printf("connection %d: recvd %d, "
+				"holding %d\n", n, recvd, held[n]);
+			stat_coalesced++;
+			return recvd;
+		}
+		held[n] = 0;
+	}
+
+	if (verbose)
+	{
+		printf("connection %d: recvd %d and ", n, recvd);
+		fflush(stdout);
+	}
+
+	sent = send_data(n, dir, buf, kept + recvd);
+	if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		sent = 0;
+	else if (sent < 1)
+	{
+		if (verbose)
+		{
+			printf("send() returned %d. ", sent);
+			if (sent == -1) printf("errno=%d ", errno);
+			printf("\n");
+		}
+		kill_connection(n);
+		return recvd;
+	}
+	if (verbose) printf("sent %d\n", sent);
+	if (sent < kept + recvd)
+	{
+		add_backlog(n, dir, sent, kept + recvd - sent);
+		conn_ready[n] &= (dir==IN) ? ~WR_IN : ~WR_OUT;
+	}
+	else
+		release_buffer(n, dir);
+	return recvd;
+}
+
+
+
+#ifdef HAVE_SPILL
+/* The receiver for dir is stalled but the sender isn't: read what it
+ * sent onto the end of the spill file, making one if need be.  Returns
+ * the number of bytes read.
+ */
+static int spill_read(const SOCKET src, const int n, const direction dir,
+	const int limit)
+{
+	int *fd    = (dir==IN)?spill_in_fd :spill_out_fd;
+	off_t *end = (dir==IN)?spill_in_end:spill_out_end;
+	char path[1024];
+	int recvd, wrote, done;
+
+	if (fd[n] < 0)
+	{
+		/* nobody else needs to see it, so unlink it straight away */
+		snprintf(path, sizeof(path), "%s/portfwd-XXXXXX", spill_dir);
+		fd[n] = mkstemp(path);
+		if (fd[n] < 0)
+		{
+			printf("Can't make a spill file in %s: %s\n",
+				spill_dir, strerror(errno));
+			spill_flags[n] |= SPILL_FAILED << dir;
+			stat_spill_failed++;
+			return 0;
+		}
+		unlink(path);
+		num_spilling++;
+		if (verbose) printf("connection %d: spilling %s\n", n,
+			(dir==IN) ? "in" : "out");
+	}
+
+	recvd = (int)recv(src, spill_buf, (limit < BACKLOG_SIZE) ? limit :
+		BACKLOG_SIZE, MSG_DONTWAIT);
+	if (recvd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		conn_ready[n] &= (dir==IN) ? ~RD_OUT : ~RD_IN;
+		return 0;
+	}
+	if (recvd == 0)
+	{
+		/* the receiver still gets what's waiting for it */
+		conn_ready[n] |= (dir==IN) ? EOF_OUT : EOF_IN;
+		conn_ready[n] &= (dir==IN) ? ~RD_OUT : ~RD_IN;
+		return 0;
+	}
+	if (recvd < 0)
+	{
+		if (verbose) printf("recv() returned -1. errno=%d\n", errno);
+		kill_connection(n);
+		return 0;
+	}
+
+	for (done=0; done<recvd; done+=wrote)
+	{
+		wrote = (int)write(fd[n], spill_buf + done, recvd - done);
+		if (wrote < 0)
+		{
+			/* what we've read has nowhere to go */
+			printf("Can't spill connection %d: %s\n", n,
+				strerror(errno));
+			stat_spill_failed++;
+			kill_connection(n);
+			return recvd;
+		}
+	}
+	end[n] += recvd;
+	stat_spilled += recvd;
+	last_active[n] = now;
+	if (usage != NULL && conn_client[n] >= 0)
+		charge_usage(n, dir, recvd);
+	if (window_bytes != NULL) note_traffic(n, recvd);
+	return recvd;
+}
+
+
+
+/* Send on what's in the spill file, closing it once it's all gone. */
+static void drain_spill(const int n, const direction dir)
+{
+	SOCKET *conn = (dir==IN)?conn_in     :conn_out;
+	int *fd      = (dir==IN)?spill_in_fd :spill_out_fd;
+	off_t *end   = (dir==IN)?spill_in_end:spill_out_end;
+	off_t *pos   = (dir==IN)?spill_in_pos:spill_out_pos;
+	ssize_t sent;
+
+	sent = sendfile(conn[n], fd[n], &pos[n], (size_t)((end[n] - pos[n] <
+		MAX_BUDGET) ? end[n] - pos[n] : MAX_BUDGET));
+	if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		conn_ready[n] &= (dir==IN) ? ~WR_IN : ~WR_OUT;
+		return;
+	}
+	if (sent < 1)
+	{
+		if (verbose)
+		{
+			printf("sendfile() returned %d. ", (int)sent);
+			if (sent == -1) printf("errno=%d ", errno);
+			printf("\n");
+		}
+		kill_connection(n);
+		return;
+	}
+	last_active[n] = now;
+
+	if (pos[n] == end[n])
+	{
+		if (verbose) printf("connection %d: drained spill\n", n);
+		close_spill(n, dir);
+	}
+	else
+		conn_ready[n] &= (dir==IN) ? ~WR_IN : ~WR_OUT;
+}
+#endif /* HAVE_SPILL */
+
+
+
+/* A link went down, and every stream on it with it. */
+static void drop_link(const int l)
+{
+	int i, k;
+
+	/* striped streams had frames on it too; downwards, since closing
+	 * one moves the last slot in use into its place */
+	for (k=slots_used-1; k>=0; k--)
+	{
+		i = slot_list[k];
+		if (stream_link[i] >= 0 && (stream_link[i] == l ||
+		    ((stream_flags[i] & STREAM_STRIPED) &&
+		     STREAM_PEER(i) == links[l].peer)))
+		{
+			unlink_stream(i, 0);
+			kill_connection(i);
+		}
+	}
+
+	closesocket(links[l].s);
+	links[l].s = INVALID_SOCKET;
+	links[l].down_since = now;
+	if (verbose) printf("Link %d down.\n", l);
+}
+
+
+
+/* Returns -1 if the other side isn't making sense. */
+static int handle_frame(const int l, const int type, const unsigned int id,
+	const char *data, const int len)
+{
+	int n = find_stream(l, id), codec, bad;
+
+	/* anything back for a stream means the server has it */
+	if (n >= 0 && tunnel == TUNNEL_CLIENT) stream_flags[n] |= STREAM_ACKED;
+	if (n >= 0) wake(n);
+
+	switch (type)
+	{
+	case FRAME_HELLO:
+		if (len < 1) return -1;
+		links[l].codecs = (unsigned char)data[0];
+		if (tunnel == TUNNEL_SERVER)
+		{
+			/* streams are hashed by peer, so it can't change */
+			if (len < 5 || links[l].streams) return -1;
+			links[l].peer = get32(data + 1);
+		}
+		break;
+
+	case FRAME_OPEN:
+		if (tunnel != TUNNEL_SERVER) return -1;
+		codec = (len > 0) ? (unsigned char)data[0] : CODEC_NONE;
+		if (codec != CODEC_NONE &&
+		    (codec > CODEC_ZSTD || !((codecs_built() >> codec) & 1)))
+			return -1;
+		if (n < 0) open_stream(l, id, codec,
+			(len > 1) ? (data[1] & STREAM_STRIPED) : 0);
+		break;
+
+	case FRAME_DATA:
+	case FRAME_PACKED:
+	case FRAME_SDATA:
+	case FRAME_SPACKED:
+		/* n < 0: we closed it, and they didn't know yet */
+		if (n < 0) break;
+		if (type == FRAME_SDATA || type == FRAME_SPACKED)
+			bad = stripe_deliver(n, type == FRAME_SPACKED,
+				data, len);
+		else
+			bad = tunnel_deliver(n, type == FRAME_PACKED,
+				data, len);
+		if (bad < 0)
+		{
+			if (verbose) printf("connection %d: stream "
+				"overran its window or won't unpack\n", n);
+			kill_connection(n);
+		}
+		break;
+
+	case FRAME_CLOSE:
+		if (n < 0) break;
+		/* striped DATA may still be on its way over other links */
+		if (len == 4 && get32(data) != stream_rx_seq[n])
+		{
+			stream_end[n] = get32(data);
+			stream_flags[n] |= STREAM_ENDING;
+		}
+		else	/* closed once what's buffered has been passed on */
+			unlink_stream(n, 0);
+		break;
+
+	case FRAME_WINDOW:
+		/* credit only comes back for what was sent */
+		if (len != 4 || (n >= 0 && get32(data) >
+				(unsigned int)(STREAM_WINDOW - stream_credit[n])))
+			return -1;
+		if (n >= 0) stream_credit[n] += (int)get32(data);
+		break;
+
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+
+
+/* Read and act on frames from link l until it runs dry. */
+static void read_link(const int l)
+{
+	struct link *k = &links[l];
+	int got, p, len;
+
+	while (k->s != INVALID_SOCKET)
+	{
+		got = (int)recv(k->s, k->rbuf + k->rlen,
+			LINK_BUF_SIZE - k->rlen, MSG_DONTWAIT);
+		if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			k->readable = 0;
+			return;
+		}
+		if (got < 1)
+		{
+			drop_link(l);
+			return;
+		}
+		k->rlen += got;
+
+		for (p=0; k->rlen - p >= FRAME_HDR; p += FRAME_HDR + len)
+		{
+			len = ((unsigned char)k->rbuf[p+6] << 8) |
+				(unsigned char)k->rbuf[p+7];
+			if (len > FRAME_MAX) goto bad;
+			if (k->rlen - p < FRAME_HDR + len) break;
+			if (handle_frame(l, (unsigned char)k->rbuf[p+4],
+				get32(k->rbuf + p), k->rbuf + p + FRAME_HDR,
+				len) < 0)
+				goto bad;
+		}
+		memmove(k->rbuf, k->rbuf + p, k->rlen - p);
+		k->rlen -= p;
+	}
+	return;
+
+bad:
+	if (verbose) printf("Link %d: bad frame.\n", l);
+	drop_link(l);
+}
+
+
+
+/* Returns non-zero if s is now link l. */
+static int setup_link(const int l, const SOCKET s)
+{
+	struct link *k = &links[l];
+	int one = 1;
+	char hello[5];
+
+#if !defined(USE_EPOLL) && !defined(_WIN32)
+	if (s >= FD_SETSIZE) return 0;
+#endif
+	if (k->rbuf == NULL)
+	{
+		k->rbuf = (char*)malloc(LINK_BUF_SIZE);
+		k->wbuf = (char*)malloc(LINK_BUF_SIZE);
+		k->wcap = LINK_BUF_SIZE;
+		if (k->rbuf == NULL || k->wbuf == NULL)
+			ERR("Can't allocate link buffers.");
+	}
+
+	/* frames are already batched per pass */
+	(void) setsockopt(s, IPPROTO_TCP, TCP_NODELAY,
+		(char*)&one, sizeof(one));
+	set_nonblocking(s);
+
+	k->s = s;
+	k->rlen = k->wpos = k->wlen = 0;
+	k->readable = k->writable = 1;
+	k->failed = k->streams = k->codecs = k->inflight = k->starved =
+		k->connecting = 0;
+
+	/* what we can unpack, and from the client, who we are */
+	hello[0] = (char)codecs_built();
+	put32(hello + 1, peer_tag);
+	link_write(l, FRAME_HELLO, 0, hello,
+		(tunnel == TUNNEL_CLIENT) ? 5 : 1);
+	k->peer = peer_tag;
+
+#ifdef USE_EPOLL
+	{
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.u32 = LINK_FLAG | (unsigned int)l;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev) < 0)
+			ERR("can't watch link");
+	}
+#endif
+	return 1;
+}
+
+
+
+/* Client side: (re)connect link l to the far portfwd. */
+static void open_link(const int l)
+{
+	struct sockaddr_in addr;
+	SOCKET s;
+	int connecting = 0;
+
+	links[l].down_since = now;
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s < 0) return;
+
+	set_nonblocking(s);
+	target_address(&addr, -1);
+	if (bind_outgoing(s) < 0)
+		goto failed;
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		if (errno != EINPROGRESS && errno != EWOULDBLOCK)
+			goto failed;
+		connecting = 1;
+	}
+	if (!setup_link(l, s))
+		goto failed;
+
+	/* the HELLO waits until link_connected() has seen it through */
+	links[l].connecting = connecting;
+	if (connecting)
+		links[l].writable = 0;
+	else if (verbose)
+		printf("Link %d up.\n", l);
+	return;
+
+failed:
+	if (verbose) printf("Link %d: can't connect: %s\n", l,
+		strerror(errno));
+	closesocket(s);
+}
+
+
+
+/* Client side: link l's connect() has finished, one way or the other.
+ * Nothing has been put on it yet, so a failure just leaves it down.
+ */
+static void link_connected(const int l)
+{
+	struct link *k = &links[l];
+	int err = 0;
+	socklen_t len = (socklen_t)sizeof(err);
+
+	if (getsockopt(k->s, SOL_SOCKET, SO_ERROR, (char*)&err, &len) < 0)
+		err = errno;
+	if (err == 0)
+	{
+		k->connecting = 0;
+		k->writable = 1;
+		if (verbose) printf("Link %d up.\n", l);
+		return;
+	}
+
+	if (verbose) printf("Link %d: can't connect: %s\n", l,
+		strerror(err));
+	closesocket(k->s);
+	k->s = INVALID_SOCKET;
+	k->readable = 0;
+}
+
+
+
+/* Server side: a far portfwd has connected. */
+static void add_link(const SOCKET s)
+{
+	int l;
+
+	for (l=0; l<num_links; l++)
+		if (links[l].s == INVALID_SOCKET)
+		{
+			if (!setup_link(l, s)) break;
+			if (verbose) printf("Link %d up.\n", l);
+			return;
+		}
+	reset_socket(s);
+}
+
+
+
+/* Only let data at a stream's link while there's credit and room. */
+static void tunnel_ready(const int n)
+{
+	int wr = (conn_in[n]==TUNNEL_SOCKET) ? WR_IN : WR_OUT;
+	int l = send_link(n);
+
+	/* room for more than a sequence number */
+	if (l >= 0 && stream_credit[n] > 0 && link_room(l) > 4)
+		conn_ready[n] |= wr;
+	else
+		conn_ready[n] &= ~wr;
+	if (l >= 0 && link_room(l) <= 4) links[l].starved = 1;
+}
+
+
+
+/* Close a stream the other side has closed, once we've passed on what
+ * it sent. */
+static void tend_stream(const int n)
+{
+	direction to_real = (conn_in[n]==TUNNEL_SOCKET) ? OUT : IN;
+
+	if (stream_link[n] < 0 && !backlog_busy(n, to_real))
+		kill_connection(n);
+}
+
+
+
+/* Start of a pass: bring links up, and read what's arrived. */
+static void service_links(void)
+{
+	int l;
+
+	for (l=0; l<num_links; l++)
+	{
+		if (tunnel == TUNNEL_CLIENT && links[l].s == INVALID_SOCKET &&
+		    (long)(now - links[l].down_since) >= LINK_RETRY_MS)
+			open_link(l);
+		if (links[l].s != INVALID_SOCKET && links[l].connecting &&
+		    (links[l].readable || links[l].writable))
+			link_connected(l);
+		if (links[l].s != INVALID_SOCKET && !links[l].connecting &&
+		    links[l].readable)
+			read_link(l);
+	}
+}
+
+
+
+/* End of a pass: send what the streams framed. */
+static void tend_links(void)
+{
+	int l, k;
+
+	for (l=0; l<num_links; l++)
+	{
+		if (links[l].s == INVALID_SOCKET) continue;
+
+		if (links[l].wlen > links[l].wpos && links[l].writable)
+			flush_link(l);
+		if (links[l].failed)
+			drop_link(l);
+		else if (links[l].starved && link_room(l) > 4)
+		{
+			/* streams were waiting for room; striped ones may
+			 * be sending on any link */
+			links[l].starved = 0;
+			for (k=0; k<slots_used; k++)
+				if (stream_link[slot_list[k]] == l ||
+				    (stream_flags[slot_list[k]] &
+					STREAM_STRIPED))
+					wake(slot_list[k]);
+			work_left = 1;
+		}
+	}
+}
+
+
+
+/* Idle pooled connections with something to say: on the backend side
+ * they're being claimed, on the public side they can only be closing. */
+static void service_pool(void)
+{
+	int i;
+
+	/* downwards, since taking an entry moves the last one into it */
+	for (i=pool_count-1; i>=0; i--)
+		if (pool_ready[i])
+		{
+			if (reverse == REVERSE_BACKEND)
+				claim_pooled(i);
+			else
+			{
+				closesocket(pool_take(i));
+				stat_pool_died++;
+			}
+		}
+}
+
+
+
+/* Public side: take idle connections from backend portfwds. */
+static void accept_pooled(void)
+{
+	SOCKET s;
+	int k;
+
+	for (k=0; k<ACCEPT_BURST && pool_count < pool_size; k++)
+	{
+		s = accept(poolin, NULL, NULL);
+		if (s < 0)
+		{
+			if (errno == EMFILE || errno == ENFILE ||
+			    errno == ENOBUFS || errno == ENOMEM)
+				pause_accepting();
+			return;
+		}
+		pool_add(s);
+	}
+}
+
+
+
+/* Backend side: top the pool back up.  Connects don't wait, so one that
+ * fails turns up later as a pooled connection that's closed. */
+static void fill_pool(void)
+{
+	SOCKET s;
+
+	while (pool_count < pool_size && (long)(now - pool_retry) >= 0)
+	{
+		s = socket(AF_INET, SOCK_STREAM, 0);
+		if (s < 0)
+		{
+			pool_retry = now + LINK_RETRY_MS;
+			return;
+		}
+		set_nonblocking(s);
+		if (bind_outgoing(s) < 0 ||
+		    (connect(s, (struct sockaddr *)&pool_addr,
+				sizeof(pool_addr)) < 0 &&
+		     errno != EINPROGRESS && errno != EWOULDBLOCK))
+		{
+			if (verbose) printf("Can't open a pooled "
+				"connection: %s\n", strerror(errno));
+			closesocket(s);
+			pool_retry = now + LINK_RETRY_MS;
+			return;
+		}
+		pool_add(s);
+	}
+}
+
+
+
+static void broken_pipe(const int signum)
 {
 	/* In Linux we can pass MSG_NOSIGNAL to send() and recv()
 	 * to suppress a SIGPIPE signal.  Other systems can't, so
@@ -320,363 +4654,2908 @@ static void broken_pipe(const int signum)
 
 
 
-static void term_signal(const int signum)
+static void stats_signal(const int signum)
+{
+	want_stats = 1;
+}
+
+
+
+static void reload_signal(const int signum)
+{
+	want_reload = 1;
+}
+
+
+
+static void term_signal(const int signum)
+{
+	int i;
+
+	if (verbose)
+	{
+		printf("Caught a SIGTERM.  Shutting down.\n");
+		print_stats();
+	}
+
+	for (i=0; i<max_connections; i++)
+	{
+		if (usage != NULL && conn_in[i] != INVALID_SOCKET &&
+		    conn_client[i] >= 0)
+			fold_usage(i);
+
+		if (conn_in[i] != INVALID_SOCKET &&
+		    conn_in[i] != TUNNEL_SOCKET)
+		{
+			shutdown(conn_in[i], 2);
+			closesocket(conn_in[i]);
+		}
+
+		if (conn_out[i] != INVALID_SOCKET &&
+		    conn_out[i] != TUNNEL_SOCKET)
+		{
+			shutdown(conn_out[i], 2);
+			closesocket(conn_out[i]);
+		}
+
+		destroy_buffer(backlog_in[i], backlog_in_class[i]);
+		destroy_buffer(backlog_out[i], backlog_out_class[i]);
+
+		while (held_frames != NULL && held_frames[i] != NULL)
+		{
+			struct held *h = held_frames[i];
+
+			held_frames[i] = h->next;
+			free(h);
+		}
+	}
+
+	for (i=0; i<NUM_CLASSES; i++)
+		while (free_buffers[i] != NULL)
+		{
+			char *buf = free_buffers[i];
+
+			free_buffers[i] = *(char**)buf;
+			destroy_buffer(buf, i);
+		}
+#ifndef _WIN32
+	if (arena != NULL) munmap(arena, arena_size);
+#endif
+
+	closesocket(sockin);
+	if (poolin != INVALID_SOCKET) closesocket(poolin);
+	for (i=0; i<pool_count; i++)
+		closesocket(pool[i]);
+	free(pool);
+	free(pool_ready);
+
+	for (i=0; i<num_links; i++)
+	{
+		if (links[i].s != INVALID_SOCKET) closesocket(links[i].s);
+		free(links[i].rbuf);
+		free(links[i].wbuf);
+	}
+	free(links);
+	free(stream_link);
+	free(stream_id);
+	free(stream_credit);
+	free(stream_owed);
+	free(stream_hash);
+	free(stream_codec);
+	free(stream_flags);
+	free(stream_tx_seq);
+	free(stream_rx_seq);
+	free(stream_end);
+	free(stream_held);
+	free(held_frames);
+	free(pack_skip);
+	free(pack_misses);
+	free(pack_buf);
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx(zstd_c);
+	ZSTD_freeDCtx(zstd_d);
+#endif
+
+	free(conn_in);
+	free(conn_out);
+	free(backlog_in);
+	free(backlog_in_size);
+	free(backlog_in_pos);
+	free(backlog_out);
+	free(backlog_out_size);
+	free(backlog_out_pos);
+	free(backlog_in_class);
+	free(backlog_out_class);
+	free(read_in_avg);
+	free(read_out_avg);
+	free(zc_in_pending);
+	free(zc_out_pending);
+	free(srcaddrs);
+	free(last_active);
+	free(conn_budget);
+	free(conn_ready);
+	free(sockmap_state);
+	free(weights);
+	for (i=0; i<num_queued; i++)
+		closesocket(queued[(queue_head + i) % max_connections]);
+	free(queued);
+	free(queued_since);
+	free(queued_route);
+	for (i=0; i<num_sniffing; i++)
+		closesocket(sniffing[i]);
+	free(sniffing);
+	free(sniff_since);
+	free(sniff_flags);
+	free(routes);
+	free(acl);
+	free(acl_sources);
+#ifndef _WIN32
+	if (usage_hdr != NULL)
+		munmap(usage_hdr, sizeof(*usage_hdr) +
+			usage_hdr->entries * sizeof(*usage));
+#endif
+	free(conn_client);
+	free(unfolded_in);
+	free(unfolded_out);
+	free(over_quota);
+	free(usage_tokens);
+	free(usage_refilled);
+#ifdef HAVE_SPILL
+	for (i=0; i<max_connections && spill_dir != NULL; i++)
+	{
+		close_spill(i, IN);
+		close_spill(i, OUT);
+	}
+	free(spill_in_fd);
+	free(spill_out_fd);
+	free(spill_in_end);
+	free(spill_out_end);
+	free(spill_in_pos);
+	free(spill_out_pos);
+	free(spill_buf);
+#endif
+	free(spill_flags);
+	free(corked_in);
+	free(corked_out);
+	free(corked_in_since);
+	free(corked_out_since);
+	free(traffic_class);
+	free(busy_ms);
+	free(busy_tick);
+	free(window_bytes);
+#ifdef HAVE_WORKERS
+	if (loads != NULL) munmap((void*)loads, num_workers * sizeof(*loads));
+	free(handoff_out);
+	free(worker_pids);
+#endif
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	exit(EXIT_SUCCESS);
+}
+
+
+
+/* The slot that has gone the longest without moving any data. */
+static int longest_idle(void)
+{
+	int i, k, victim = -1;
+
+	for (k=0; k<slots_used; k++)
+	{
+		i = slot_list[k];
+		if (victim < 0 ||
+		    (long)(last_active[i] - last_active[victim]) < 0)
+			victim = i;
+	}
+	return victim;
+}
+
+
+
+static void overloaded(const SOCKET incoming, const int route)
+{
+	int victim, i;
+
+	switch (overload)
+	{
+	case OVERLOAD_QUEUE:
+		if (num_queued < max_connections)
+		{
+			i = (queue_head + num_queued) % max_connections;
+			queued[i] = incoming;
+			queued_since[i] = now;
+			queued_route[i] = route;
+			num_queued++;
+			stat_overload_queued++;
+			if (verbose) printf("Queued client, %d waiting\n",
+				num_queued);
+			return;
+		}
+		break;
+
+	case OVERLOAD_SHED:
+		/* closing a spliced connection doesn't refill the pool */
+		victim = (reverse == REVERSE_PUBLIC && !pool_count) ? -1 :
+			longest_idle();
+		if (victim >= 0)
+		{
+			if (verbose) printf("Shedding idle connection %d\n",
+				victim);
+			kill_connection(victim);
+			stat_overload_shed++;
+			start_connection(incoming, route);
+			return;
+		}
+		break;
+
+	case OVERLOAD_WAIT:
+		printf("ERROR: Maximum limit reached."
+			"This should not happen!\n");
+		closesocket(incoming);
+		return;
+
+	default:
+		break;
+	}
+
+	reset_socket(incoming);
+	stat_overload_reset++;
+}
+
+
+
+/* Start a client off on route, if there's room for it. */
+static void admit(const SOCKET incoming, const int route)
+{
+	if (!have_capacity() || num_queued)
+		overloaded(incoming, route);
+	else
+		start_connection(incoming, route);
+}
+
+
+
+/* Pack the signatures for sniff_protocol(). */
+static void init_signatures(void)
+{
+	int i, j;
+
+	for (i=0; i<NUM_SIGNATURES; i++)
+		for (j=0; j<signatures[i].len; j++)
+		{
+			sig_mask[i][j] = signatures[i].mask ?
+				(unsigned char)signatures[i].mask[j] : 0xFF;
+			sig_bytes[i][j] = (unsigned char)signatures[i].bytes[j] &
+				sig_mask[i][j];
+		}
+}
+
+
+
+/* What a client speaks, going by the len bytes it has sent so far in p
+ * (which must be readable, and zero, PEEK_PAD bytes past them).  Returns
+ * a PROTO_*, or -1 if it's too soon to tell.
+ */
+static int sniff_protocol(const unsigned char *p, const int len)
+{
+	unsigned int seen = 0, eq, room;
+	int i, proto;
+
+	/* bytes that haven't arrived yet can't mismatch */
+	room = (len >= 16) ? 0 : (0xFFFFU << len) & 0xFFFF;
+
+#if defined(HAVE_AVX2)
+	{
+		__m256i in = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *)p));
+
+		/* two signatures at a time, one in each lane */
+		for (i=0; i<NUM_SIGNATURES; i+=2)
+		{
+			eq = (unsigned int)_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(_mm256_and_si256(in,
+				_mm256_loadu_si256((const __m256i *)sig_mask[i])),
+				_mm256_loadu_si256((const __m256i *)sig_bytes[i])));
+			eq |= room | room << 16;
+			seen |= (unsigned int)((eq & 0xFFFF) == 0xFFFF) << i;
+			seen |= (unsigned int)((eq >> 16) == 0xFFFF) << (i + 1);
+		}
+	}
+#elif defined(HAVE_SSE2)
+	{
+		__m128i in = _mm_loadu_si128((const __m128i *)p);
+
+		for (i=0; i<NUM_SIGNATURES; i++)
+		{
+			eq = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_and_si128(in,
+				_mm_loadu_si128((const __m128i *)sig_mask[i])),
+				_mm_loadu_si128((const __m128i *)sig_bytes[i])));
+			seen |= (unsigned int)((eq | room) == 0xFFFF) << i;
+		}
+	}
+#else
+	for (i=0; i<NUM_SIGNATURES; i++)
+	{
+		int j;
+
+		for (j=0; j<signatures[i].len && j<len; j++)
+			if ((p[j] & sig_mask[i][j]) != sig_bytes[i][j])
+				break;
+		seen |= (unsigned int)(j == signatures[i].len || j == len) << i;
+	}
+	(void) eq;
+	(void) room;
+#endif
+
+	/* the first one matched in full, unless one matched so far might
+	 * still be */
+	proto = PROTO_NONE;
+	for (i=NUM_SIGNATURES-1; i>=0; i--)
+		if ((seen >> i) & 1)
+		{
+			if (len < signatures[i].len) return -1;
+			proto = signatures[i].proto;
+		}
+	return proto;
+}
+
+
+
+/* Where the first c in p[from] to p[to-1] is, or to if there isn't one.
+ * p must be readable PEEK_PAD bytes past to.
+ */
+static int find_byte(const char *p, int from, const int to, const char c)
+{
+#if defined(HAVE_AVX2)
+	__m256i want = _mm256_set1_epi8(c);
+	unsigned int hit;
+
+	for (; from < to; from += 32)
+	{
+		hit = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *)(p + from)), want));
+		if (hit)
+			return (from + __builtin_ctz(hit) < to) ?
+				from + __builtin_ctz(hit) : to;
+	}
+	return to;
+#elif defined(HAVE_SSE2)
+	__m128i want = _mm_set1_epi8(c);
+	unsigned int hit;
+
+	for (; from < to; from += 16)
+	{
+		hit = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)(p + from)), want));
+		if (hit)
+			return (from + __builtin_ctz(hit) < to) ?
+				from + __builtin_ctz(hit) : to;
+	}
+	return to;
+#else
+	while (from < to && p[from] != c) from++;
+	return from;
+#endif
+}
+
+
+
+/* The server name in a TLS ClientHello.  Returns 1 with it in name, 0 if
+ * there isn't one, or -1 if more of the hello is needed to tell.
+ */
+static int tls_server_name(const unsigned char *p, const int len,
+	char *name, const int size)
+{
+	int rec, pos, end, n;
+
+#define U16(i) (p[i] << 8 | p[(i) + 1])
+#define NEED(x) if (pos + (x) > rec) return 0; \
+		if (pos + (x) > len) return -1
+
+	/* only the first record, which any sane hello starts in */
+	rec = 5 + U16(3);
+	pos = 5;
+	NEED(4);
+	pos += 4;			/* handshake type and length */
+	NEED(35);
+	pos += 34;			/* version, random */
+	pos += 1 + p[pos];		/* session id */
+	NEED(2);
+	pos += 2 + U16(pos);		/* cipher suites */
+	NEED(1);
+	pos += 1 + p[pos];		/* compression methods */
+	NEED(2);
+	end = pos + 2 + U16(pos);
+	pos += 2;
+
+	while (pos < end)
+	{
+		NEED(4);
+		if (U16(pos) != 0)	/* not server_name */
+		{
+			pos += 4 + U16(pos + 2);
+			continue;
+		}
+
+		/* list length, then a host_name entry */
+		pos += 4;
+		NEED(5);
+		n = U16(pos + 3);
+		if (p[pos + 2] != 0 || n < 1 || n >= size) return 0;
+		NEED(5 + n);
+		memcpy(name, p + pos + 5, n);
+		name[n] = 0;
+		return 1;
+	}
+	return 0;
+
+#undef NEED
+#undef U16
+}
+
+
+
+/* The Host header of an HTTP/1 request, without a port.  Returns the same
+ * as tls_server_name().
+ */
+static int http_host(const char *p, const int len, char *name,
+	const int size)
+{
+	int pos = 0, line, n;
+
+	for (;;)
+	{
+		/* on to the next whole line */
+		pos = find_byte(p, pos, len, '\n');
+		line = ++pos;
+		pos = find_byte(p, pos, len, '\n');
+		if (pos >= len) return -1;
+
+		/* a blank line ends the headers */
+		if (pos - line <= 1) return 0;
+		if (pos - line > 5 && (p[line] | 0x20) == 'h' &&
+		    strncasecmp(p + line, "host:", 5) == 0)
+			break;
+	}
+
+	line += 5;
+	while (p[line] == ' ' || p[line] == '\t') line++;
+	for (n=0; line+n < pos && p[line+n] != ':' && p[line+n] != ' ' &&
+		p[line+n] != '\r' && p[line+n] != '\t'; n++)
+		;
+	if (n < 1 || n >= size) return 0;
+	memcpy(name, p + line, n);
+	name[n] = 0;
+	return 1;
+}
+
+
+
+/* The database a PostgreSQL startup message asks for, or failing that
+ * the user, which it defaults to.  Returns the same as tls_server_name().
+ */
+static int pg_database(const char *p, const int len, char *name,
+	const int size)
+{
+	int end, pos, key, value = -1, n;
+
+	/* SSLRequest and the like have nothing to go on */
+	if (p[4] != 0 || p[5] != 3) return 0;
+	end = (unsigned char)p[2] << 8 | (unsigned char)p[3];
+	if (end > len) return (len < PEEK_SIZE) ? -1 : 0;
+
+	/* pairs of strings, ended by an empty one */
+	for (pos=8; pos < end && p[pos]; pos++)
+	{
+		key = pos;
+		pos = find_byte(p, pos, end, 0) + 1;
+		if (pos >= end) return 0;
+		if (strcmp(p + key, "database") == 0 ||
+		    (value < 0 && strcmp(p + key, "user") == 0))
+			value = pos;
+		pos = find_byte(p, pos, end, 0);
+		if (pos >= end) return 0;
+	}
+	if (value < 0) return 0;
+
+	n = (int)strlen(p + value);
+	if (n < 1 || n >= size) return 0;
+	memcpy(name, p + value, n + 1);
+	return 1;
+}
+
+
+
+/* What a client speaking proto is routed by.  Returns the same as
+ * tls_server_name().
+ */
+static int routing_key(const int proto, const char *p, const int len,
+	char *name, const int size)
+{
+	switch (proto)
+	{
+	case PROTO_TLS:
+		return tls_server_name((const unsigned char *)p, len, name,
+			size);
+	case PROTO_HTTP:
+		return http_host(p, len, name, size);
+	case PROTO_POSTGRES:
+		return pg_database(p, len, name, size);
+	default:
+		return 0;
+	}
+}
+
+
+
+/* The first route for a client speaking proto, whose key (or NULL) is
+ * name, or -1 for none.
+ */
+static int find_route(const int proto, const char *name)
+{
+	int r, skip;
+
+	for (r=0; r<num_routes; r++)
+	{
+		if (routes[r].proto != PROTO_NONE)
+		{
+			if (routes[r].proto == proto) return r;
+			continue;
+		}
+		if (name == NULL)
+			continue;
+		if (strncmp(routes[r].name, "*.", 2) != 0)
+		{
+			if (strcasecmp(routes[r].name, name) == 0) return r;
+			continue;
+		}
+
+		/* a subdomain: one or more labels in front of the rest */
+		skip = (int)strlen(name) - (int)strlen(routes[r].name + 1);
+		if (skip > 0 && strcasecmp(name + skip, routes[r].name + 1) == 0)
+			return r;
+	}
+	return -1;
+}
+
+
+
+/* Take client i off the list of those waiting to be routed. */
+static SOCKET sniff_take(const int i)
+{
+	SOCKET s = sniffing[i];
+
+	num_sniffing--;
+	sniffing[i] = sniffing[num_sniffing];
+	sniff_since[i] = sniff_since[num_sniffing];
+	sniff_flags[i] = sniff_flags[num_sniffing];
+#ifdef USE_EPOLL
+	{
+		struct epoll_event ev;
+
+		(void) epoll_ctl(epfd, EPOLL_CTL_DEL, s, &ev);
+
+		/* the last client's events now say where it's gone; only
+		 * the newest can be unwatched yet, and it is the last */
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		ev.data.u32 = SNIFF_FLAG | (unsigned int)i;
+		if (i < num_sniffing &&
+		    epoll_ctl(epfd, EPOLL_CTL_MOD, sniffing[i], &ev) < 0)
+			ERR("can't watch client waiting to be routed");
+	}
+#endif
+	return s;
+}
+
+
+
+/* Peek at what waiting client i has sent, and start it off if that says
+ * where it's going.  Returns non-zero if it's no longer waiting.
+ */
+static int route_client(const int i)
+{
+	char buf[PEEK_SIZE + PEEK_PAD], name[256];
+	int len, proto, found, r;
+
+	sniff_flags[i] = 0;
+	len = (int)recv(sniffing[i], buf, PEEK_SIZE, MSG_PEEK);
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			errno == EINTR))
+		return 0;
+	if (len <= 0)
+	{
+		if (verbose) printf("Client left before sending.\n");
+		closesocket(sniff_take(i));
+		return 1;
+	}
+
+	memset(buf + len, 0, PEEK_PAD);
+
+	proto = sniff_protocol((unsigned char *)buf, len);
+	found = routing_key(proto, buf, len, name, sizeof(name));
+	if ((proto < 0 || found < 0) && len < PEEK_SIZE)
+	{
+		/* the rest should be on its way */
+		sniff_flags[i] = SNIFF_PARTIAL;
+		return 0;
+	}
+	if (proto < 0) proto = PROTO_NONE;
+
+	r = find_route(proto, (found > 0) ? name : NULL);
+	stat_protos[proto]++;
+	if (r >= 0) stat_routed++;
+	else stat_route_default++;
+	if (verbose) printf("%s client for '%s' goes to %s\n",
+		proto_names[proto], (found > 0) ? name : "",
+		(r >= 0) ? routes[r].name : "the default");
+	admit(sniff_take(i), r);
+	return 1;
+}
+
+
+
+/* Hold a new client until it says where it's going. */
+static void sniff_client(const SOCKET incoming)
+{
+	int i;
+
+#if !defined(USE_EPOLL) && !defined(_WIN32)
+	if (incoming >= FD_SETSIZE)
+	{
+		reset_socket(incoming);
+		pause_accepting();
+		return;
+	}
+#endif
+	set_nonblocking(incoming);
+
+	i = num_sniffing++;
+	sniffing[i] = incoming;
+	sniff_since[i] = now;
+	if (i == 0) sniff_wake = now + ROUTE_WAIT_MS;
+
+	/* often it already has, especially with -deferaccept */
+	if (route_client(i)) return;
+
+#ifdef USE_EPOLL
+	{
+		struct epoll_event ev;
+
+		/* edge-triggered: a peek doesn't drain anything, and only
+		 * more data is worth another one */
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		ev.data.u32 = SNIFF_FLAG | (unsigned int)i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, incoming, &ev) < 0)
+			ERR("can't watch client waiting to be routed");
+	}
+#endif
+}
+
+
+
+/* Route the waiting clients that have sent something, or waited long
+ * enough, and work out when the next one will have.
+ */
+static void service_sniffing(void)
+{
+	int i;
+
+	sniff_wake = now + ROUTE_WAIT_MS;
+
+	/* downwards, since taking an entry moves the last one into it */
+	for (i=num_sniffing-1; i>=0; i--)
+	{
+		if ((sniff_flags[i] & SNIFF_READY) && route_client(i))
+			continue;
+		if ((long)(now - sniff_since[i]) >= ROUTE_WAIT_MS)
+		{
+			if (verbose) printf("Nothing to route by, using "
+				"the default.\n");
+			stat_route_default++;
+			admit(sniff_take(i), -1);
+			continue;
+		}
+		if ((long)(sniff_since[i] + ROUTE_WAIT_MS - sniff_wake) < 0)
+			sniff_wake = sniff_since[i] + ROUTE_WAIT_MS;
+	}
+}
+
+
+
+/* Returns non-zero if a client was taken off the accept queue. */
+static int accept_incoming(void)
+{
+	struct sockaddr_in addrin;
+	socklen_t sin_size;
+	SOCKET incoming;
+
+	sin_size = (socklen_t)sizeof(struct sockaddr);
+	incoming = accept(sockin, (struct sockaddr *)&addrin,
+			&sin_size);
+	if (incoming < 0)
+	{
+		switch (errno)
+		{
+		case EMFILE:
+		case ENFILE:
+#ifndef _WIN32
+			/* sockin stays readable until the client is taken
+			 * off the queue, so use the spare descriptor to do
+			 * that rather than spin on it */
+			if (spare_fd >= 0)
+			{
+				close(spare_fd);
+				incoming = accept(sockin, NULL, NULL);
+				if (incoming >= 0) reset_socket(incoming);
+				spare_fd = open("/dev/null", O_RDONLY);
+			}
+#endif
+			/* FALLTHROUGH */
+		case ENOBUFS:
+		case ENOMEM:
+			pause_accepting();
+			break;
+
+		case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+		case ECONNABORTED:
+		case EINTR:
+			break;
+
+		default:
+			if (verbose) printf("accept() freaked out.\n");
+			break;
+		}
+		return 0;
+	}
+
+	accept_backoff = 0;
+
+	/* before it costs us anything */
+	if (acl != NULL && acl_denied(ntohl(addrin.sin_addr.s_addr)))
+	{
+		if (verbose) printf("Denied %s\n",
+			inet_ntoa(addrin.sin_addr));
+		closesocket(incoming);
+		stat_denied++;
+		return 1;
+	}
+	if (usage != NULL && quota && !quota_rate)
+	{
+		int c = usage_slot(ntohl(addrin.sin_addr.s_addr), 0);
+
+		if (c >= 0 && usage_total(c) >= quota)
+		{
+			if (verbose) printf("%s is over quota\n",
+				inet_ntoa(addrin.sin_addr));
+			closesocket(incoming);
+			stat_over_quota++;
+			return 1;
+		}
+	}
+	stat_accepted++;
+	if (verbose)
+		printf("Got a connection from %s:%u. active=%d\n",
+			inet_ntoa(addrin.sin_addr),
+			ntohs(addrin.sin_port),
+			active_connections);
+
+	if (tunnel == TUNNEL_SERVER)
+		add_link(incoming);
+	else if (num_routes && num_sniffing < max_connections)
+		sniff_client(incoming);
+	else
+		admit(incoming, -1);
+	return 1;
+}
+
+
+
+/* Hand free slots to queued clients, and give up on the ones that
+ * have waited too long.
+ */
+static void service_queue(void)
+{
+	while (num_queued && have_capacity())
+	{
+		start_connection(queued[queue_head],
+			queued_route[queue_head]);
+		queue_head = (queue_head + 1) % max_connections;
+		num_queued--;
+	}
+
+	while (num_queued &&
+	       (long)(now - queued_since[queue_head]) >= queue_deadline)
+	{
+		reset_socket(queued[queue_head]);
+		queue_head = (queue_head + 1) % max_connections;
+		num_queued--;
+		stat_queue_expired++;
+	}
+}
+
+
+
+/* Move data in one direction until the source runs dry, the destination
+ * fills up, or the connection's budget for this pass is spent.
+ */
+#ifdef HAVE_SOCKMAP
+/* Hand quiet connections to the kernel, and close drained ones. */
+static void tend_sockmap(const int n)
+{
+	switch (sockmap_state[n])
+	{
+	case SOCKMAP_USERSPACE:
+		if (!(conn_ready[n] & (RD_IN|RD_OUT)) &&
+		    !backlog_busy(n, IN) && !backlog_busy(n, OUT))
+			sockmap_offload(n);
+		break;
+
+	case SOCKMAP_DRAINING:
+		if ((unsent(conn_in[n]) == 0 && unsent(conn_out[n]) == 0) ||
+		    (long)(now - last_active[n]) > DRAIN_TIMEOUT)
+			kill_connection(n);
+		else
+			wake(n);	/* look again in DRAIN_POLL_MS */
+		break;
+
+	default:
+		break;
+	}
+}
+#endif
+
+
+
+static void service(const int n, const direction dir)
+{
+	SOCKET src        = (dir==IN)?conn_out[n]    :conn_in[n];
+	int *backlog_size = (dir==IN)?backlog_in_size:backlog_out_size;
+	int rd_src        = (dir==IN)?RD_OUT         :RD_IN;
+	int wr_dest       = (dir==IN)?WR_IN          :WR_OUT;
+	int eof_src       = (dir==IN)?EOF_OUT        :EOF_IN;
+	unsigned long *since = (dir==IN)?corked_in_since:corked_out_since;
+	int budget = conn_budget[n], throttled = 0, more;
+	long allowance;
+	unsigned long due;
+
+	/* bulk ones take smaller bites */
+	if (classify == CLASSIFY_AUTO && traffic_class[n] == TRAFFIC_BULK)
+		budget /= BULK_SHARE;
+
+	if (usage != NULL && valid_socket(n) && over_quota[n])
+	{
+		if (!quota_rate)
+		{
+			if (verbose) printf("connection %d: closing, "
+				"over quota\n", n);
+			kill_connection(n);
+			return;
+		}
+		allowance = quota_allowance(conn_client[n]);
+		if (allowance < budget)
+		{
+			budget = (allowance > 0) ? (int)allowance : 0;
+			throttled = 1;
+		}
+	}
+
+	/* held back long enough */
+	if (valid_socket(n) && corked(n, dir) &&
+	    (long)(now_us - since[n]) >= coalesce_us)
+		uncork(n, dir);
+
+	while (valid_socket(n))
+	{
+		if (backlog_size[n])
+		{
+			if (conn_ready[n] & wr_dest)
+				flush_backlog(n, dir);
+#ifdef HAVE_SPILL
+			else if (budget > 0 && (conn_ready[n] & rd_src) &&
+				 can_spill(n, dir))
+				budget -= spill_read(src, n, dir, budget);
+#endif
+			else
+				break;
+		}
+#ifdef HAVE_SPILL
+		else if (spilled(n, dir))
+		{
+			if (conn_ready[n] & wr_dest)
+				drain_spill(n, dir);
+			else if (budget > 0 && (conn_ready[n] & rd_src) &&
+				 can_spill(n, dir))
+				budget -= spill_read(src, n, dir, budget);
+			else
+				break;
+		}
+#endif
+		else if (budget > 0 && !backlog_busy(n, dir) &&
+			 (conn_ready[n] & rd_src) &&
+			 (conn_ready[n] & wr_dest))
+			budget -= bounce(src, n, dir, budget);
+		else
+			break;
+	}
+
+	/* the sender has closed: so can we, once the receiver has it all */
+	if (valid_socket(n) && (conn_ready[n] & eof_src) && drained(n, dir))
+	{
+		kill_connection(n);
+		return;
+	}
+
+	/* wake up in time to send what's still held back */
+	if (valid_socket(n) && corked(n, dir))
+	{
+		due = since[n] + coalesce_us;
+		if (!num_corked++ || (long)(due - cork_wake) < 0)
+			cork_wake = due;
+		wake(n);
+	}
+
+	/* out of budget with more to read: don't block next time, or if
+	 * it's the quota holding it back, not for long */
+	if (!valid_socket(n) || budget > 0 || !(conn_ready[n] & rd_src))
+		return;
+	more = (conn_ready[n] & wr_dest) && !backlog_busy(n, dir);
+#ifdef HAVE_SPILL
+	if ((backlog_size[n] || spilled(n, dir)) && can_spill(n, dir))
+		more = 1;
+#endif
+	if (more)
+	{
+		if (throttled)
+			quota_wake = 1;
+		else
+			work_left = 1;
+		wake(n);
+	}
+}
+
+
+
+/* Whether sockin should be watched at all right now. */
+static int can_accept(void)
+{
+	int l;
+
+	/* the far end of a tunnel only accepts links */
+	if (tunnel == TUNNEL_SERVER)
+	{
+		for (l=0; l<num_links; l++)
+			if (links[l].s == INVALID_SOCKET)
+				return !accept_paused();
+		return 0;
+	}
+
+	/* rather than turn clients away, wait for a link that's coming up */
+	if (tunnel == TUNNEL_CLIENT)
+	{
+		int up = 0, connecting = 0;
+
+		for (l=0; l<num_links; l++)
+			if (links[l].s != INVALID_SOCKET)
+			{
+				if (links[l].connecting)
+					connecting = 1;
+				else
+					up = 1;
+			}
+		if (connecting && !up) return 0;
+	}
+
+	return (have_capacity() || overload != OVERLOAD_WAIT) &&
+		!accept_paused();
+}
+
+
+
+#ifdef HAVE_WORKERS
+/* Whether n can go to another worker as just its sockets: nothing of
+ * it is held here, and the kernel isn't forwarding it for us. */
+static int can_hand_off(const int n)
+{
+	if ((conn_ready[n] & (EOF_IN|EOF_OUT|CONNECTING)) ||
+	    !drained(n, IN) || !drained(n, OUT))
+		return 0;
+#ifdef HAVE_SOCKMAP
+	if (use_sockmap && sockmap_state[n] != SOCKMAP_USERSPACE &&
+	    sockmap_state[n] != SOCKMAP_PINNED)
+		return 0;
+#endif
+	return 1;
+}
+
+
+
+/* Queue a connection's sockets and state for worker w.  Returns zero
+ * if its queue is full.
+ */
+static int send_handoff(const int w, struct handoff *h, const int *fds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = h;
+	iov.iov_len = sizeof(*h);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, 2 * sizeof(int));
+
+	if (sendmsg(handoff_out[w], &msg, MSG_DONTWAIT) < 0)
+	{
+		if (verbose) printf("Can't hand a connection to worker %d: "
+			"%s\n", w, strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+
+
+/* Hand connection n over to worker w, if it'll fit in its queue. */
+static int hand_off(const int n, const int w)
+{
+	struct handoff h;
+	int fds[2];
+
+	memset(&h, 0, sizeof(h));
+	h.from = worker;
+	h.read_in_avg = read_in_avg[n];
+	h.read_out_avg = read_out_avg[n];
+	if (traffic_class != NULL) h.traffic_class = traffic_class[n];
+
+	fds[0] = conn_in[n];
+	fds[1] = conn_out[n];
+	if (!send_handoff(w, &h, fds)) return 0;
+
+	/* the sockets live on in the message, so they'd stay watched */
+#ifdef USE_EPOLL
+	(void) epoll_ctl(epfd, EPOLL_CTL_DEL, conn_in[n], NULL);
+	(void) epoll_ctl(epfd, EPOLL_CTL_DEL, conn_out[n], NULL);
+#endif
+	if (verbose) printf("connection %d: handed off to worker %d\n",
+		n, w);
+	stat_handed_off++;
+	kill_connection(n);
+	return 1;
+}
+
+
+
+/* Post our load, and if we're carrying well over our share, hand the
+ * connection that best evens things out to the least busy worker.
+ */
+static void rebalance(const long elapsed)
+{
+	unsigned long total = 0, mine = 0, rate, gap;
+	int i, k, w, target = -1, pick = -1;
+
+	for (k=0; k<slots_used; k++)
+		mine += window_bytes[slot_list[k]];
+	mine = (unsigned long)(mine * 1000.0 / elapsed);
+	loads[worker].rate = mine;
+	loads[worker].room = max_connections - active_connections -
+		num_sniffing;
+
+	if (rebalance_wait > 0)
+	{
+		rebalance_wait--;
+		return;
+	}
+	for (w=0; w<num_workers; w++)
+	{
+		total += loads[w].rate;
+		if (w != worker && loads[w].room > 0 &&
+		    (target < 0 || loads[w].rate < loads[target].rate))
+			target = w;
+	}
+	if (target < 0 || active_connections < 2 || mine < REBALANCE_MIN ||
+	    mine <= REBALANCE_RATIO * total / num_workers ||
+	    mine <= loads[target].rate)
+		return;
+
+	/* moving a connection of rate r under the gap narrows it */
+	gap = mine - loads[target].rate;
+	for (k=0; k<slots_used; k++)
+	{
+		i = slot_list[k];
+		if (!can_hand_off(i)) continue;
+		rate = (unsigned long)(window_bytes[i] * 1000.0 / elapsed);
+		if (rate > 0 && rate < gap &&
+		    (pick < 0 || window_bytes[i] > window_bytes[pick]))
+			pick = i;
+	}
+	if (pick >= 0 && hand_off(pick, target))
+		rebalance_wait = REBALANCE_WAIT;
+}
+
+
+
+/* Take in connections other workers have handed us. */
+static void take_handoffs(void)
+{
+	struct handoff h;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	int fds[2], curr;
+
+	for (;;)
+	{
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = &h;
+		iov.iov_len = sizeof(h);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		if (recvmsg(handoff_in, &msg, MSG_DONTWAIT) != sizeof(h))
+		{
+			handoff_ready = 0;
+			return;
+		}
+		cm = CMSG_FIRSTHDR(&msg);
+		if (cm == NULL || cm->cmsg_level != SOL_SOCKET ||
+		    cm->cmsg_type != SCM_RIGHTS ||
+		    cm->cmsg_len != CMSG_LEN(sizeof(fds)))
+			continue;
+		memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+		/* Our last slot went to someone else since we posted the
+		 * room.  It goes back once, and is turned away after that. */
+		if (active_connections + num_sniffing >= max_connections
+#ifndef USE_EPOLL
+		    || fds[0] >= FD_SETSIZE || fds[1] >= FD_SETSIZE
+#endif
+		    )
+		{
+			if (!h.returned)
+			{
+				h.returned = 1;
+				if (send_handoff(h.from, &h, fds))
+				{
+					closesocket(fds[0]);
+					closesocket(fds[1]);
+					continue;
+				}
+			}
+			reset_socket(fds[0]);
+			closesocket(fds[1]);
+			stat_overload_reset++;
+			continue;
+		}
+
+		active_connections++;
+		curr = free_slot();
+		install_connection(curr, fds[0], fds[1]);
+		read_in_avg[curr] = h.read_in_avg;
+		read_out_avg[curr] = h.read_out_avg;
+		if (classify == CLASSIFY_AUTO)
+		{
+			traffic_class[curr] = h.traffic_class;
+			mark_connection(curr);
+		}
+
+		/* whatever arrived on the way is waiting in the sockets */
+		conn_ready[curr] |= RD_IN | RD_OUT;
+		stat_taken_over++;
+		if (verbose) printf("connection %d: taken over from worker "
+			"%d\n", curr, h.from);
+	}
+}
+#endif /* HAVE_WORKERS */
+
+
+
+/* At the end of each window, act on what connections did in it. */
+static void end_window(void)
+{
+	long elapsed = (long)(now - window_start);
+	int k;
+
+	if (elapsed < WINDOW_MS) return;
+
+	if (classify == CLASSIFY_AUTO) classify_connections(elapsed);
+#ifdef HAVE_WORKERS
+	if (num_workers > 1) rebalance(elapsed);
+#endif
+	for (k=0; k<slots_used; k++)
+		busy_ms[slot_list[k]] = window_bytes[slot_list[k]] = 0;
+	window_start = now;
+}
+
+
+
+#ifdef USE_EPOLL
+static void wait_for_events(const long wait_us)
+{
+	struct epoll_event ev[MAX_EVENTS];
+	int i, n, events_ret;
+	direction side;
+#ifdef HAVE_EPOLL_PWAIT2
+	static int no_pwait2 = 0;	/* the kernel is older than 5.11 */
+	struct timespec ts;
+#endif
+
+	/* sockin is level-triggered and only watched while we can accept */
+	if (can_accept() != sockin_watched)
+	{
+		sockin_watched = !sockin_watched;
+		ev[0].events = sockin_watched ? EPOLLIN : 0;
+		ev[0].data.u32 = SOCKIN_ID;
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, sockin, &ev[0]) < 0)
+			ERR("can't change watch on incoming socket");
+	}
+	if (poolin != INVALID_SOCKET &&
+	    (pool_count < pool_size && !accept_paused()) != poolin_watched)
+	{
+		poolin_watched = !poolin_watched;
+		ev[0].events = poolin_watched ? EPOLLIN : 0;
+		ev[0].data.u32 = POOLIN_ID;
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, poolin, &ev[0]) < 0)
+			ERR("can't change watch on pool socket");
+	}
+
+	/* coalescing deadlines want better than milliseconds */
+#ifdef HAVE_EPOLL_PWAIT2
+	if (!no_pwait2)
+	{
+		ts.tv_sec = wait_us / 1000000;
+		ts.tv_nsec = (wait_us % 1000000) * 1000;
+		events_ret = epoll_pwait2(epfd, ev, MAX_EVENTS,
+			(wait_us >= 0) ? &ts : NULL, NULL);
+		if (events_ret == -1 && errno == ENOSYS) no_pwait2 = 1;
+	}
+	if (no_pwait2)
+#endif
+	events_ret = epoll_wait(epfd, ev, MAX_EVENTS,
+		(wait_us >= 0) ? (int)((wait_us + 999) / 1000) : -1);
+	if (events_ret == -1 && errno == EINTR) return;
+	if (events_ret == -1) ERR("epoll_wait() error");
+
+	for (i=0; i<events_ret; i++)
+	{
+		if (ev[i].data.u32 == SOCKIN_ID)
+		{
+			sockin_ready = 1;
+			continue;
+		}
+		if (ev[i].data.u32 == POOLIN_ID)
+		{
+			poolin_ready = 1;
+			continue;
+		}
+#ifdef HAVE_WORKERS
+		if (ev[i].data.u32 == HANDOFF_ID)
+		{
+			handoff_ready = 1;
+			continue;
+		}
+#endif
+		if (ev[i].data.u32 & LINK_FLAG)
+		{
+			n = (int)(ev[i].data.u32 & ~LINK_FLAG);
+			if (ev[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR))
+				links[n].readable = 1;
+			if (ev[i].events & (EPOLLOUT|EPOLLHUP|EPOLLERR))
+				links[n].writable = 1;
+			continue;
+		}
+		if (ev[i].data.u32 & POOL_FLAG)
+		{
+			n = (int)(ev[i].data.u32 & ~POOL_FLAG);
+			if (n < pool_count) pool_ready[n] = 1;
+			continue;
+		}
+		if (ev[i].data.u32 & SNIFF_FLAG)
+		{
+			n = (int)(ev[i].data.u32 & ~SNIFF_FLAG);
+			if (n < num_sniffing) sniff_flags[n] |= SNIFF_READY;
+			continue;
+		}
+
+		n = (int)(ev[i].data.u32 / 2);
+		side = (ev[i].data.u32 & 1) ? OUT : IN;
+		if (!valid_socket(n)) continue;
+
+		if (ev[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR))
+			conn_ready[n] |= (side==IN) ? RD_IN : RD_OUT;
+		if (ev[i].events & (EPOLLOUT|EPOLLHUP|EPOLLERR))
+			conn_ready[n] |= (side==IN) ? WR_IN : WR_OUT;
+		wake(n);
+
+#ifdef HAVE_ZEROCOPY
+		/* zerocopy completions are signalled as errors */
+		if (ev[i].events & EPOLLERR) reap_zerocopy(n, side);
+#endif
+	}
+}
+
+#else /* !USE_EPOLL */
+
+/* Whether to read for dir: only if there's somewhere to put it. */
+static int read_wanted(const int n, const direction dir)
+{
+#ifdef HAVE_SPILL
+	int *backlog_size = (dir==IN)?backlog_in_size:backlog_out_size;
+
+	if (backlog_size[n] || spilled(n, dir))
+		return can_spill(n, dir);
+#endif
+	return !backlog_busy(n, dir);
+}
+
+
+
+static void wait_for_events(const long wait_us)
+{
+	fd_set r_fd, w_fd;
+	struct timeval timeout;
+	SOCKET max_fd = 0;
+	int select_ret, i, k;
+
+	FD_ZERO(&r_fd);
+	FD_ZERO(&w_fd);
+
+	if (can_accept())
+	{
+		FD_SET(sockin, &r_fd);
+		max_fd = sockin;
+	}
+	if (poolin != INVALID_SOCKET && pool_count < pool_size &&
+	    !accept_paused())
+	{
+		FD_SET(poolin, &r_fd);
+		max_fd = max(max_fd, poolin);
+	}
+	for (i=0; i<pool_count; i++)
+	{
+		FD_SET(pool[i], &r_fd);
+		max_fd = max(max_fd, pool[i]);
+	}
+#ifdef HAVE_WORKERS
+	if (handoff_in != INVALID_SOCKET)
+	{
+		FD_SET(handoff_in, &r_fd);
+		max_fd = max(max_fd, handoff_in);
+	}
+#endif
+	/* what's waiting has been peeked at, so it would just spin */
+	for (i=0; i<num_sniffing; i++)
+	if (!(sniff_flags[i] & SNIFF_PARTIAL))
+	{
+		FD_SET(sniffing[i], &r_fd);
+		max_fd = max(max_fd, sniffing[i]);
+	}
+
+	for (i=0; i<num_links; i++)
+	if (links[i].s != INVALID_SOCKET)
+	{
+		FD_SET(links[i].s, &r_fd);
+		if (!links[i].writable) FD_SET(links[i].s, &w_fd);
+		max_fd = max(max_fd, links[i].s);
+	}
+
+	/* only ask about what we don't already know, and only read from
+	 * a socket when there's room to put what we read */
+	for (k=0; k<slots_used; k++)
+	{
+		i = slot_list[k];
+
+		/* in a tunnel, one side is the link's business */
+		if (conn_in[i] != TUNNEL_SOCKET)
+		{
+			if (!(conn_ready[i] & RD_IN) && read_wanted(i, OUT))
+				FD_SET(conn_in[i], &r_fd);
+			if (!(conn_ready[i] & WR_IN))
+				FD_SET(conn_in[i], &w_fd);
+			max_fd = max(max_fd, conn_in[i]);
+		}
+		if (conn_out[i] != TUNNEL_SOCKET)
+		{
+			if (!(conn_ready[i] & RD_OUT) && read_wanted(i, IN))
+				FD_SET(conn_out[i], &r_fd);
+			if (!(conn_ready[i] & WR_OUT))
+				FD_SET(conn_out[i], &w_fd);
+			max_fd = max(max_fd, conn_out[i]);
+		}
+
+#ifdef HAVE_ZEROCOPY
+		/* zerocopy completions make the socket readable */
+		if (zc_in_pending[i]) FD_SET(conn_in[i], &r_fd);
+		if (zc_out_pending[i]) FD_SET(conn_out[i], &r_fd);
+#endif
+	}
+
+	if (wait_us >= 0)
+	{
+		timeout.tv_sec = wait_us / 1000000;
+		timeout.tv_usec = wait_us % 1000000;
+	}
+
+	/* poll! */
+	select_ret = select(max_fd+1, &r_fd, &w_fd, NULL,
+		(wait_us >= 0) ? &timeout : NULL);
+	if (select_ret == -1 && errno == EINTR) return;
+	if (select_ret == 0 && wait_us < 0)
+		ERR("select()'s infinite timeout just timed out.");
+	if (select_ret == -1) ERR("select() error");
+
+	sockin_ready = FD_ISSET(sockin, &r_fd);
+	poolin_ready = (poolin != INVALID_SOCKET && FD_ISSET(poolin, &r_fd));
+	for (i=0; i<pool_count; i++)
+		pool_ready[i] = FD_ISSET(pool[i], &r_fd);
+#ifdef HAVE_WORKERS
+	handoff_ready = (handoff_in != INVALID_SOCKET &&
+		FD_ISSET(handoff_in, &r_fd));
+#endif
+	for (i=0; i<num_sniffing; i++)
+		if ((sniff_flags[i] & SNIFF_PARTIAL) ||
+		    FD_ISSET(sniffing[i], &r_fd))
+			sniff_flags[i] |= SNIFF_READY;
+
+	for (i=0; i<num_links; i++)
+	if (links[i].s != INVALID_SOCKET)
+	{
+		if (FD_ISSET(links[i].s, &r_fd)) links[i].readable = 1;
+		if (FD_ISSET(links[i].s, &w_fd)) links[i].writable = 1;
+	}
+
+	for (k=0; k<slots_used; k++)
+	{
+		i = slot_list[k];
+		if (conn_in[i] != TUNNEL_SOCKET)
+		{
+			if (FD_ISSET(conn_in[i], &r_fd))
+				conn_ready[i] |= RD_IN;
+			if (FD_ISSET(conn_in[i], &w_fd))
+				conn_ready[i] |= WR_IN;
+		}
+		if (conn_out[i] != TUNNEL_SOCKET)
+		{
+			if (FD_ISSET(conn_out[i], &r_fd))
+				conn_ready[i] |= RD_OUT;
+			if (FD_ISSET(conn_out[i], &w_fd))
+				conn_ready[i] |= WR_OUT;
+		}
+		if ((conn_in[i] != TUNNEL_SOCKET &&
+		     (FD_ISSET(conn_in[i], &r_fd) ||
+		      FD_ISSET(conn_in[i], &w_fd))) ||
+		    (conn_out[i] != TUNNEL_SOCKET &&
+		     (FD_ISSET(conn_out[i], &r_fd) ||
+		      FD_ISSET(conn_out[i], &w_fd))))
+			wake(i);
+
+#ifdef HAVE_ZEROCOPY
+		if (zc_in_pending[i] && FD_ISSET(conn_in[i], &r_fd))
+			reap_zerocopy(i, IN);
+		if (zc_out_pending[i] && FD_ISSET(conn_out[i], &r_fd))
+			reap_zerocopy(i, OUT);
+#endif
+	}
+}
+#endif /* USE_EPOLL */
+
+
+
+static void poll_conn(void)
+{
+	int i, k, pass, last, count, *list;
+	long wait_ms, pause_ms, wait_us, pause_us;
+
+	if (want_stats)
+	{
+		want_stats = 0;
+		print_stats();
+	}
+	if (want_reload)
+	{
+		want_reload = 0;
+		reload_acl();
+	}
+	now = get_time_ms();
+
+	/* wait indefinitely, unless there's work left over from the last
+	 * pass, a queued client's deadline is due, or accepting is paused */
+	wait_ms = -1;
+	if (num_queued)
+		wait_ms = max(0, queue_deadline -
+			(long)(now - queued_since[queue_head]));
+	if (accept_paused())
+	{
+		pause_ms = (long)(accept_resume - now);
+		if (wait_ms < 0 || pause_ms < wait_ms) wait_ms = pause_ms;
+	}
+#ifdef HAVE_SOCKMAP
+	/* nothing wakes us when a draining connection's data is acked */
+	if (num_draining && (wait_ms < 0 || wait_ms > DRAIN_POLL_MS))
+		wait_ms = DRAIN_POLL_MS;
+#endif
+	/* retry links that are down */
+	for (k=0; k<num_links && tunnel == TUNNEL_CLIENT; k++)
+		if (links[k].s == INVALID_SOCKET &&
+		    (wait_ms < 0 || wait_ms > LINK_RETRY_MS))
+			wait_ms = LINK_RETRY_MS;
+	/* top up the pool once the retry delay is over */
+	if (reverse == REVERSE_BACKEND && pool_count < pool_size)
+	{
+		pause_ms = max(0, (long)(pool_retry - now));
+		if (wait_ms < 0 || pause_ms < wait_ms) wait_ms = pause_ms;
+	}
+	/* route clients that have waited long enough; without epoll, peek
+	 * again every so often at those that have only sent part of it */
+	if (num_sniffing)
+	{
+		pause_ms = max(0, (long)(sniff_wake - now));
+#ifndef USE_EPOLL
+		for (k=0; k<num_sniffing; k++)
+			if ((sniff_flags[k] & SNIFF_PARTIAL) &&
+			    pause_ms > DRAIN_POLL_MS)
+				pause_ms = DRAIN_POLL_MS;
+#endif
+		if (wait_ms < 0 || pause_ms < wait_ms) wait_ms = pause_ms;
+	}
+	/* throttled connections get more allowance as time passes */
+	if (quota_wake && (wait_ms < 0 || wait_ms > QUOTA_TICK_MS))
+		wait_ms = QUOTA_TICK_MS;
+	if (work_left) wait_ms = 0;
+
+	/* held back data is due in microseconds */
+	if (wait_ms > WAIT_MAX_MS) wait_ms = WAIT_MAX_MS;
+	wait_us = (wait_ms < 0) ? -1 : wait_ms * 1000;
+	if (num_corked)
+	{
+		pause_us = max(0, (long)(cork_wake - get_time_us()));
+		if (wait_us < 0 || pause_us < wait_us) wait_us = pause_us;
+	}
+
+	sockin_ready = poolin_ready = work_left = quota_wake = 0;
+	num_corked = 0;
+	wait_for_events(wait_us);
+	now = get_time_ms();
+	if (coalesce_min) now_us = get_time_us();
+
+	if (tunnel != TUNNEL_NONE) service_links();
+	if (reverse != REVERSE_NONE)
+	{
+		service_pool();
+		if (poolin_ready) accept_pooled();
+		if (reverse == REVERSE_BACKEND) fill_pool();
+	}
+	if (num_sniffing) service_sniffing();
+#ifdef HAVE_WORKERS
+	if (handoff_ready) take_handoffs();
+#endif
+
+	/* handle incoming connections if there are any */
+	if (sockin_ready)
+		for (k=0; k<ACCEPT_BURST && can_accept() &&
+				accept_incoming(); k++)
+			;
+
+	/* Service the slots that were woken, and start somewhere else in
+	 * the list each time so the same ones don't always get served
+	 * first; interactive connections go before bulk ones, and the last
+	 * pass takes whatever is left.  Slots woken from here on are for
+	 * the next pass.
+	 */
+	if (window_bytes != NULL) end_window();
+	list = ready_list;
+	count = num_ready;
+	ready_list = ready_next;
+	ready_next = list;
+	num_ready = 0;
+	for (k=0; k<count; k++)
+		is_ready[list[k]] = READY_NOW;
+	last = (classify == CLASSIFY_AUTO);
+	for (pass=0; pass<=last; pass++)
+	for (k=0; k<count; k++)
+	{
+		i = list[(rr_start + k) % count];
+		if (is_ready[i] != READY_NOW) continue;
+		if (pass < last && valid_socket(i) && traffic_class[i] != pass)
+			continue;
+		is_ready[i] = 0;
+		if (!valid_socket(i)) continue;
+
+		/* nothing moves until the server side is connected */
+		if ((conn_ready[i] & CONNECTING) && !finish_connect(i))
+			continue;
+		if (tunnel != TUNNEL_NONE) tunnel_ready(i);
+		service(i, OUT);
+		service(i, IN);
+#ifdef HAVE_SOCKMAP
+		if (use_sockmap && valid_socket(i)) tend_sockmap(i);
+#endif
+		if (tunnel != TUNNEL_NONE && valid_socket(i)) tend_stream(i);
+	}
+	rr_start = (rr_start + 1) % max_connections;
+
+	if (tunnel != TUNNEL_NONE) tend_links();
+
+	if (num_queued) service_queue();
+}
+
+
+
+/* Fetch the value for the option at argv[*i], or bail out. */
+static const char *next_arg(const int argc, char **argv, int *i,
+	const char *what)
+{
+	if (++*i >= argc)
+	{
+		printf("You didn't specify %s.\n", what);
+		exit(EXIT_FAILURE);
+	}
+	return argv[*i];
+}
+
+
+
+/* A byte count with an optional K, M or G after it, or -1. */
+static double parse_bytes(const char *arg)
+{
+	char *end;
+	double n = strtod(arg, &end);
+
+	switch (*end)
+	{
+	case 'G': case 'g': n *= 1024;	/* FALLTHROUGH */
+	case 'M': case 'm': n *= 1024;	/* FALLTHROUGH */
+	case 'K': case 'k': n *= 1024;
+		end++;
+		break;
+	}
+	return (end == arg || *end || n < 1) ? -1 : n;
+}
+
+
+
+/* A nonblocking socket listening on port. */
+static SOCKET open_listener(const int port)
+{
+	struct sockaddr_in addrin;
+	int sockopt;
+	SOCKET s;
+
+	/* create the incoming socket */
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s < 0) ERR("problem creating incoming socket");
+
+	/* fill out a sockaddr struct */
+	addrin.sin_family = AF_INET;
+	addrin.sin_port = htons(port);
+	addrin.sin_addr.s_addr = INADDR_ANY;
+	memset(&(addrin.sin_zero), 0, 8);
+
+	/* reuse address */
+	sockopt = 1;
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char*)&sockopt,
+				sizeof(sockopt)) < 0)
+		ERR("can't REUSEADDR");
+#ifdef HAVE_WORKERS
+	/* every worker listens, and the kernel spreads clients over them */
+	if (num_workers > 1 &&
+	    setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (char*)&sockopt,
+				sizeof(sockopt)) < 0)
+		ERR("can't REUSEPORT");
+#endif
+
+	/* bind it to the incoming port */
+	if (bind(s, (struct sockaddr *)&addrin,
+		sizeof(struct sockaddr)) < 0)
+	{
+#ifndef _WIN32
+		if (getuid() != 0 && port < 1024)
+			ERR("problem binding incoming socket\n\
+You need to be root to bind to a port under 1024.");
+		else
+#endif
+			ERR("problem binding incoming socket\n\
+Maybe it's already in use?");
+	}
+
+	/* listen on the socket */
+	if (listen(s, max_connections) < 0)
+		ERR("problem listen()ing to incoming socket");
+
+	set_nonblocking(s);
+	return s;
+}
+
+
+
+#ifdef HAVE_WORKERS
+/* In the parent, pass signals on to the workers. */
+static void forward_signal(const int signum)
+{
+	int w;
+
+	for (w=0; w<num_workers; w++)
+		if (worker_pids[w] > 0) kill(worker_pids[w], signum);
+}
+
+
+
+/* Worker w binds only from its own slice of the source port range, so
+ * the workers don't race each other for the same ports, and starts on
+ * a different source address from the others.
+ */
+static void shard_sources(const int w)
+{
+	int range = srcport_hi - srcport_lo + 1;
+
+	if (srcport_lo)
+	{
+		srcport_hi = srcport_lo + (w + 1) * range / num_workers - 1;
+		srcport_lo = srcport_lo + w * range / num_workers;
+		srcport_next = 0;
+	}
+	if (num_srcaddrs) next_srcaddr = w % num_srcaddrs;
+}
+
+
+
+/* Fork the workers, and return in each of them.  The parent stays to
+ * pass signals on, and goes when they do; if one dies, so do the rest.
+ */
+static void start_workers(void)
+{
+	int w, v, status, alive, failed = 0;
+	int (*pairs)[2];
+	pid_t pid;
+
+	loads = (struct worker_load*)mmap(NULL,
+		num_workers * sizeof(*loads), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	pairs = (int(*)[2])malloc(num_workers * sizeof(*pairs));
+	handoff_out = (SOCKET*)malloc(num_workers * sizeof(SOCKET));
+	worker_pids = (pid_t*)calloc(num_workers, sizeof(pid_t));
+	if (loads == MAP_FAILED || pairs == NULL || handoff_out == NULL ||
+	    worker_pids == NULL)
+		ERR("Can't allocate worker state.");
+
+	/* anyone can send on pairs[w][1]; only worker w reads pairs[w][0] */
+	for (w=0; w<num_workers; w++)
+	{
+		if (socketpair(AF_UNIX, SOCK_DGRAM, 0, pairs[w]) < 0)
+			ERR("can't make handoff sockets");
+		set_nonblocking(pairs[w][0]);
+		set_nonblocking(pairs[w][1]);
+		handoff_out[w] = pairs[w][1];
+		loads[w].room = max_connections;
+	}
+
+	fflush(stdout);
+	for (w=0; w<num_workers; w++)
+	{
+		pid = fork();
+		if (pid < 0) ERR("can't fork worker %d", w);
+		if (pid == 0)
+		{
+			worker = w;
+			shard_sources(w);
+			handoff_in = pairs[w][0];
+			for (v=0; v<num_workers; v++)
+				if (v != w) close(pairs[v][0]);
+			free(pairs);
+			return;
+		}
+		worker_pids[w] = pid;
+	}
+	for (w=0; w<num_workers; w++)
+	{
+		close(pairs[w][0]);
+		close(pairs[w][1]);
+	}
+	free(pairs);
+
+	(void) signal(SIGTERM, forward_signal);
+	(void) signal(SIGINT, forward_signal);
+	(void) signal(SIGUSR1, forward_signal);
+	(void) signal(SIGHUP, forward_signal);
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	for (alive=num_workers; alive > 0; )
+	{
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0)
+		{
+			if (errno == EINTR) continue;
+			break;
+		}
+		for (w=0; w<num_workers && worker_pids[w] != pid; w++)
+			;
+		if (w == num_workers) continue;
+		worker_pids[w] = 0;
+		alive--;
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+		{
+			if (!failed)
+				printf("Worker %d died, stopping the rest.\n",
+					w);
+			failed = 1;
+			forward_signal(SIGTERM);
+		}
+	}
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+#endif /* HAVE_WORKERS */
+
+
+
+int main(int argc, char **argv)
 {
 	int i;
+	const char *arg;
+
+	/* usage */
+	if (argc < 3)
+	{
+		printf(
+"TCP Port Forwarder\n(c) 2000-2003, Emil Mikulic.\n\n"
+"usage: %s <src port> <remote ip>:<port> [options]\n\n"
+"options:\n"
+"  -max <x>            maximum number of connections (default %d)\n"
+"  -v                  verbose\n"
+"  -zerocopy <bytes>   use MSG_ZEROCOPY for sends of at least this size\n"
+"  -fastopen <qlen>    TCP Fast Open on both legs\n"
+"  -deferaccept <sec>  don't accept until the client sends data\n"
+"  -srcip <ip>         source address for outgoing connections\n"
+"                      (repeat to round-robin over a pool)\n"
+"  -srcports <lo>-<hi> source port range for outgoing connections\n"
+"  -overload <policy>  when full: reset, queue <ms> or shed\n"
+"                      (default: leave clients in the accept queue)\n"
+"  -budget <bytes>     most bytes a connection moves per direction in\n"
+"                      one pass, reading until EAGAIN (default %d)\n"
+"  -weight <ip>[/<bits>] <x>\n"
+"                      clients in this network get x times the budget\n"
+"  -fionread           size each read by what's waiting (FIONREAD)\n"
+"  -arena <MB>         size of the buffer arena (0: use malloc; default:\n"
+"                      enough for every slot)\n"
+"  -mlock              fault in and lock the arena\n"
+"  -sockmap            forward in the kernel with a BPF sockmap (Linux,\n"
+"                      needs root)\n"
+"  -tunnel <links>     carry clients over this many persistent links to\n"
+"                      a portfwd running with -untunnel\n"
+"  -untunnel           take tunnel links from a portfwd running with\n"
+"                      -tunnel, and connect each stream to the server\n"
+"  -compress <codec>   compress tunnel streams with lz4 or zstd, if both\n"
+"                      ends were built with it\n"
+"  -stripe             spread each tunnel stream over all the links\n"
+"  -pool <port>        take idle connections on this port from portfwds\n"
+"                      running with -reverse, and splice each client onto\n"
+"                      one instead of connecting to the remote\n"
+"  -reverse <ip>:<port> <n>\n"
+"                      keep n idle connections open to a portfwd running\n"
+"                      with -pool there, and connect each to the remote\n"
+"                      when a client claims it\n"
+"  -allow <file>       only take clients from the IPv4 prefixes listed in\n"
+"                      the file, one per line (<ip>[/<bits>])\n"
+"  -deny <file>        turn away clients from the prefixes in the file;\n"
+"                      the longest matching prefix wins (SIGHUP rereads)\n"
+"  -usage <file>       count the bytes each client moves in this file,\n"
+"                      which is made if it isn't there\n"
+"  -usage-prefix <bits>\n"
+"                      count clients together by network (default: 32)\n"
+"  -quota <bytes>[K|M|G]\n"
+"                      close connections of clients that have moved this\n"
+"                      much in all, and turn them away from then on\n"
+"  -quota-rate <bytes>[K|M|G]\n"
+"                      rather than close them, slow them down to this\n"
+"                      many bytes a second\n"
+"  -spill <dir>        when a receiver stalls, keep reading from the\n"
+"                      sender into files here rather than stall it too\n"
+"  -spill-mem <bytes>[K|M|G]\n"
+"                      socket buffer to fill before spilling (default: 4M)\n"
+"  -spill-max <bytes>[K|M|G]\n"
+"                      largest spill file per connection and direction\n"
+"  -coalesce <bytes> <usec>\n"
+"                      hold small reads back until there are this many\n"
+"                      bytes or the oldest has waited this long, then\n"
+"                      send them in one go\n"
+"  -classify <auto|interactive|bulk>\n"
+"                      mark connections as interactive or bulk with\n"
+"                      IP_TOS and SO_PRIORITY; auto tells them apart by\n"
+"                      how they behave, and serves interactive ones first\n"
+"  -dscp <0-63>        mark connections with this DSCP instead\n"
+"  -workers <n>        run n worker processes sharing the port, each\n"
+"                      with up to -max connections; busy ones hand\n"
+"                      connections to idle ones\n"
+"  -proxyv2            tell the server who each client is with a PROXY\n"
+"                      protocol v2 header\n"
+"  -route <name> <ip>:<port>\n"
+"                      send clients asking for this TLS server name,\n"
+"                      HTTP Host or PostgreSQL database there instead\n"
+"                      (*.<domain> matches its subdomains, and @tls,\n"
+"                      @http, @h2, @ssh, @redis or @postgres every client\n"
+"                      speaking it; repeat for more, first match wins)\n"
+"\n", argv[0], max_connections, DEFAULT_BUDGET);
+		return EXIT_SUCCESS;
+	}
+
+	/* arg1: local port */
+	localport = atoi(argv[1]);
+	if (localport == 0)
+	{
+		printf("'%s' is a silly local port to use.\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	/* arg2: target */
+	remotehost = argv[2];
+	for (i=0; i<(int)strlen(argv[2]); i++)
+	{
+		if (argv[2][i] == ':') {
+			argv[2][i] = 0;
+			i++;
+			remoteport = atoi(argv[2]+i);
+			break;
+		}
+	}
+
+	if (argv[2][i] == 0)
+	{
+		printf("You didn't specify a remote port!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (remoteport == 0)
+	{
+		printf("'%s' is a silly remote port to use.\n", argv[2]+i);
+		return EXIT_FAILURE;
+	}
+
+	/* the rest: options */
+	for (i=3; i<argc; i++)
+	{
+		if (strcmp(argv[i],"-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[i],"-max") == 0)
+		{
+			arg = next_arg(argc, argv, &i,
+				"the maximum number of connections");
+			max_connections = atoi(arg);
+			if (max_connections < 1 || max_connections > MAX_SLOTS)
+			{
+				printf("'%s' is a silly maximum.\n", arg);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (strcmp(argv[i],"-zerocopy") == 0)
+		{
+			arg = next_arg(argc, argv, &i,
+				"the minimum size for zerocopy sends");
+			zerocopy_min = atoi(arg);
+			if (zerocopy_min < 1 || zerocopy_min > BACKLOG_SIZE)
+			{
+				printf("'%s' is a silly zerocopy size.\n", arg);
+				return EXIT_FAILURE;
+			}
+#ifndef HAVE_ZEROCOPY
+			printf("MSG_ZEROCOPY isn't supported here, "
+				"ignoring -zerocopy.\n");
+			zerocopy_min = 0;
+#endif
+		}
+		else if (strcmp(argv[i],"-fastopen") == 0)
+		{
+			arg = next_arg(argc, argv, &i,
+				"the fast open queue length");
+			fastopen_qlen = atoi(arg);
+			if (fastopen_qlen < 1)
+			{
+				printf("'%s' is a silly queue length.\n", arg);
+				return EXIT_FAILURE;
+			}
+#if !defined(TCP_FASTOPEN) || !defined(MSG_FASTOPEN)
+			printf("TCP Fast Open isn't supported here, "
+				"ignoring -fastopen.\n");
+			fastopen_qlen = 0;
+#endif
+		}
+		else if (strcmp(argv[i],"-deferaccept") == 0)
+		{
+			arg = next_arg(argc, argv, &i,
+				"the TCP_DEFER_ACCEPT timeout");
+			defer_accept = atoi(arg);
+			if (defer_accept < 1)
+			{
+				printf("'%s' is a silly timeout.\n", arg);
+				return EXIT_FAILURE;
+			}
+#ifndef TCP_DEFER_ACCEPT
+			printf("TCP_DEFER_ACCEPT isn't supported here, "
+				"ignoring -deferaccept.\n");
+			defer_accept = 0;
+#endif
+		}
+		else if (strcmp(argv[i],"-srcip") == 0)
+		{
+			arg = next_arg(argc, argv, &i, "a source address");
+			srcaddrs = (struct in_addr*)realloc(srcaddrs,
+				(num_srcaddrs+1) * sizeof(struct in_addr));
+			if (srcaddrs == NULL)
+				ERR("Can't allocate source address pool.");
+			srcaddrs[num_srcaddrs].s_addr = inet_addr(arg);
+			if (srcaddrs[num_srcaddrs].s_addr == INADDR_NONE)
+			{
+				printf("'%s' is a silly source address.\n",
+					arg);
+				return EXIT_FAILURE;
+			}
+			num_srcaddrs++;
+		}
+		else if (strcmp(argv[i],"-srcports") == 0)
+		{
+			arg = next_arg(argc, argv, &i,
+				"a source port range");
+			if (sscanf(arg, "%d-%d", &srcport_lo, &srcport_hi) != 2
+			 || srcport_lo < 1 || srcport_hi > 65535
+			 || srcport_lo > srcport_hi)
+			{
+				printf("'%s' is a silly port range.\n", arg);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (strcmp(argv[i],"-overload") == 0)
+		{
+			arg = next_arg(argc, argv, &i, "an overload policy");
+			if (strcmp(arg,"reset") == 0)
+				overload = OVERLOAD_RESET;
+			else if (strcmp(arg,"shed") == 0)
+				overload = OVERLOAD_SHED;
+			else if (strcmp(arg,"queue") == 0)
+			{
+				overload = OVERLOAD_QUEUE;
+				arg = next_arg(argc, argv, &i,
+					"the queueing deadline");
+				queue_deadline = atoi(arg);
+				if (queue_deadline < 1)
+				{
+					printf("'%s' is a silly deadline.\n",
+						arg);
+					return EXIT_FAILURE;
+				}
+			}
+			else
+			{
+				printf("'%s' is a silly overload policy.\n",
+					arg);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (strcmp(argv[i],"-fionread") == 0)
+		{
+#ifdef FIONREAD
+			use_fionread = 1;
+#else
+			printf("FIONREAD isn't supported here, "
+				"ignoring -fionread.\n");
+#endif
+		}
+		else if (strcmp(argv[i],"-arena") == 0)
+		{
+			arg = next_arg(argc, argv, &i, "the arena size");
+			arena_mb = atoi(arg);
+			if (arena_mb < 0 || (arena_mb == 0 && *arg != '0'))
+			{
+				printf("'%s' is a silly arena size.\n", arg);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (strcmp(argv[i],"-mlock") == 0)
+			lock_arena = 1;
+		else if (strcmp(argv[i],"-tunnel") == 0)
+		{
+			arg = next_arg(argc, argv, &i,
+				"the number of tunnel links");
+			num_links = atoi(arg);
+			if (num_links < 1 || num_links > MAX_LINKS)
+			{
+				printf("'%s' is a silly number of links.\n",
+					arg);
+				return EXIT_FAILURE;
+			}
+			tunnel = TUNNEL_CLIENT;
+		}
+		else if (strcmp(argv[i],"-untunnel") == 0)
+		{
+			num_links = MAX_LINKS;
+			tunnel = TUNNEL_SERVER;
+		}
+		else if (strcmp(argv[i],"-stripe") == 0)
+			use_stripes = 1;
+		else if (strcmp(argv[i],"-pool") == 0)
+		{
+			arg = next_arg(argc, argv, &i,
+				"the port for pooled connections");
+			pool_port = atoi(arg);
+			if (pool_port < 1 || pool_port > 65535)
+			{
+				printf("'%s' is a silly pool port.\n", arg);
+				return EXIT_FAILURE;
+			}
+			reverse = REVERSE_PUBLIC;
+		}
+		else if (strcmp(argv[i],"-reverse") == 0)
+		{
+			char host[32];
+			int port = 0;
+
+			arg = next_arg(argc, argv, &i,
+				"where the -pool portfwd is");
+			if (sscanf(arg, "%31[0-9.]:%d", host, &port) < 2 ||
+			    inet_addr(host) == INADDR_NONE ||
+			    port < 1 || port > 65535)
+			{
+				printf("'%s' is a silly address.\n", arg);
+				return EXIT_FAILURE;
+			}
+			memset(&pool_addr, 0, sizeof(pool_addr));
+			pool_addr.sin_family = AF_INET;
+			pool_addr.sin_port = htons(port);
+			pool_addr.sin_addr.s_addr = inet_addr(host);
+
+			arg = next_arg(argc, argv, &i, "the pool size");
+			pool_size = atoi(arg);
+			if (pool_size < 1 || pool_size > MAX_SLOTS)
+			{
+				printf("'%s' is a silly pool size.\n", arg);
+				return EXIT_FAILURE;
+			}
+			reverse = REVERSE_BACKEND;
+		}
+		else if (strcmp(argv[i],"-allow") == 0 ||
+			 strcmp(argv[i],"-deny") == 0)
+		{
+			acl_sources = (struct acl_source*)realloc(acl_sources,
+				(num_acl_sources+1) * sizeof(*acl_sources));
+			if (acl_sources == NULL)
+				ERR("Can't allocate access lists.");
+			acl_sources[num_acl_sources].deny =
+				(strcmp(argv[i],"-deny") == 0);
+			acl_sources[num_acl_sources].path = next_arg(argc,
+				argv, &i, "an access list file");
+			num_acl_sources++;
+		}
+		else if (strcmp(argv[i],"-usage") == 0)
+			usage_path = next_arg(argc, argv, &i, "a usage file");
+		else if (strcmp(argv[i],"-usage-prefix") == 0)
+		{
+			arg = next_arg(argc, argv, &i, "a prefix length");
+			usage_bits = atoi(arg);
+			if (usage_bits < 0 || usage_bits > 32 ||
+			    arg[strspn(arg, "0123456789")])
+			{
+				printf("'%s' is a silly prefix length.\n", arg);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (strcmp(argv[i],"-quota") == 0)
+		{
+			double n;
+
+			arg = next_arg(argc, argv, &i, "a quota");
+			if ((n = parse_bytes(arg)) < 0)
+			{
+				printf("'%s' is a silly quota.\n", arg);
+				return EXIT_FAILURE;
+			}
+			quota = (unsigned long long)n;
+		}
+		else if (strcmp(argv[i],"-quota-rate") == 0)
+		{
+			double n;
+
+			arg = next_arg(argc, argv, &i, "a rate");
+			if ((n = parse_bytes(arg)) < 0 || n > MAX_BUDGET)
+			{
+				printf("'%s' is a silly rate.\n", arg);
+				return EXIT_FAILURE;
+			}
+			quota_rate = (long)n;
+		}
+		else if (strcmp(argv[i],"-spill") == 0)
+		{
+			arg = next_arg(argc, argv, &i, "a spill directory");
+#ifdef HAVE_SPILL
+			spill_dir = arg;
+#else
+			printf("Spilling needs sendfile(), ignoring -spill.\n");
+#endif
+		}
+		else if (strcmp(argv[i],"-spill-mem") == 0 ||
+			 strcmp(argv[i],"-spill-max") == 0)
+		{
+			int mem = (strcmp(argv[i],"-spill-mem") == 0);
+			double n;
+
+			arg = next_arg(argc, argv, &i, "a size");
+			if ((n = parse_bytes(arg)) < 0 ||
+			    (mem && n > MAX_BUDGET))
+			{
+				printf("'%s' is a silly size.\n", arg);
+				return EXIT_FAILURE;
+			}
+#ifdef HAVE_SPILL
+			if (mem)
+				spill_mem = (int)n;
+			else
+				spill_max = (off_t)n;
+#endif
+		}
+		else if (strcmp(argv[i],"-coalesce") == 0)
+		{
+			arg = next_arg(argc, argv, &i,
+				"how much to coalesce");
+			coalesce_min = atoi(arg);
+			if (coalesce_min < 1 || coalesce_min > BACKLOG_SIZE)
+			{
+				printf("'%s' is a silly amount to coalesce.\n",
+					arg);
+				return EXIT_FAILURE;
+			}
+			arg = next_arg(argc, argv, &i, "a coalescing deadline");
+			coalesce_us = atol(arg);
+			if (coalesce_us < 1 || coalesce_us > 1000000 ||
+			    arg[strspn(arg, "0123456789")])
+			{
+				printf("'%s' is a silly deadline.\n", arg);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (strcmp(argv[i],"-classify") == 0)
+		{
+			arg = next_arg(argc, argv, &i, "a traffic class");
+			if (strcmp(arg, "auto") == 0)
+				classify = CLASSIFY_AUTO;
+			else if (strcmp(arg, "interactive") == 0)
+				classify = CLASSIFY_INTERACTIVE;
+			else if (strcmp(arg, "bulk") == 0)
+				classify = CLASSIFY_BULK;
+			else
+			{
+				printf("'%s' isn't auto, interactive or bulk.\n",
+					arg);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (strcmp(argv[i],"-dscp") == 0)
+		{
+			arg = next_arg(argc, argv, &i, "a DSCP");
+			dscp = atoi(arg);
+			if (dscp < 0 || dscp > 63 || !*arg ||
+			    arg[strspn(arg, "0123456789")])
+			{
+				printf("'%s' is a silly DSCP.\n", arg);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (strcmp(argv[i],"-workers") == 0)
+		{
+			arg = next_arg(argc, argv, &i,
+				"the number of workers");
+			num_workers = atoi(arg);
+			if (num_workers < 1 || num_workers > MAX_WORKERS)
+			{
+				printf("'%s' is a silly number of workers.\n",
+					arg);
+				return EXIT_FAILURE;
+			}
+#ifndef HAVE_WORKERS
+			printf("Workers need fork() and SO_REUSEPORT, "
+				"ignoring -workers.\n");
+			num_workers = 1;
+#endif
+		}
+		else if (strcmp(argv[i],"-proxyv2") == 0)
+			proxy_protocol = 1;
+		else if (strcmp(argv[i],"-route") == 0)
+		{
+			char host[32];
+			int port = 0;
 
-	if (verbose) printf("Caught a SIGTERM.  Shutting down.\n");
+			routes = (struct route*)realloc(routes,
+				(num_routes+1) * sizeof(*routes));
+			if (routes == NULL)
+				ERR("Can't allocate routes.");
+			routes[num_routes].name = next_arg(argc, argv, &i,
+				"a name to route");
+			routes[num_routes].proto = PROTO_NONE;
+			if (routes[num_routes].name[0] == '@')
+			{
+				int k;
 
-	for (i=0; i<max_connections; i++)
-	{
-		if (conn_in[i] != INVALID_SOCKET)
+				for (k=1; k<NUM_PROTOS; k++)
+					if (strcmp(routes[num_routes].name + 1,
+						   proto_names[k]) == 0)
+						routes[num_routes].proto = k;
+				if (routes[num_routes].proto == PROTO_NONE)
+				{
+					printf("'%s' is a silly protocol.\n",
+						routes[num_routes].name);
+					return EXIT_FAILURE;
+				}
+			}
+
+			arg = next_arg(argc, argv, &i, "where to route it");
+			if (sscanf(arg, "%31[0-9.]:%d", host, &port) < 2 ||
+			    inet_addr(host) == INADDR_NONE ||
+			    port < 1 || port > 65535)
+			{
+				printf("'%s' is a silly address.\n", arg);
+				return EXIT_FAILURE;
+			}
+			memset(&routes[num_routes].addr, 0,
+				sizeof(routes[num_routes].addr));
+			routes[num_routes].addr.sin_family = AF_INET;
+			routes[num_routes].addr.sin_port = htons(port);
+			routes[num_routes].addr.sin_addr.s_addr =
+				inet_addr(host);
+			num_routes++;
+		}
+		else if (strcmp(argv[i],"-compress") == 0)
 		{
-			shutdown(conn_in[i], 2);
-			closesocket(conn_in[i]);
+			arg = next_arg(argc, argv, &i, "a codec");
+			if (strcmp(arg, "lz4") == 0)
+				compress_codec = CODEC_LZ4;
+			else if (strcmp(arg, "zstd") == 0)
+				compress_codec = CODEC_ZSTD;
+			else
+			{
+				printf("'%s' is a silly codec.\n", arg);
+				return EXIT_FAILURE;
+			}
+			if (!((codecs_built() >> compress_codec) & 1))
+			{
+				printf("%s isn't built in, ignoring "
+					"-compress.\n", arg);
+				compress_codec = CODEC_NONE;
+			}
 		}
-
-		if (conn_out[i] != INVALID_SOCKET)
+		else if (strcmp(argv[i],"-sockmap") == 0)
 		{
-			shutdown(conn_out[i], 2);
-			closesocket(conn_out[i]);
+#ifdef HAVE_SOCKMAP
+			use_sockmap = 1;
+#else
+			printf("BPF sockmaps aren't supported here, "
+				"ignoring -sockmap.\n");
+#endif
 		}
+		else if (strcmp(argv[i],"-budget") == 0)
+		{
+			arg = next_arg(argc, argv, &i, "the byte budget");
+			byte_budget = atoi(arg);
+			if (byte_budget < 1 || byte_budget > MAX_BUDGET)
+			{
+				printf("'%s' is a silly budget.\n", arg);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (strcmp(argv[i],"-weight") == 0)
+		{
+			char net[32];
+			int bits = 32;
 
-		free(backlog_in[i]);
-		free(backlog_out[i]);
-	}
-
-	closesocket(sockin);
+			arg = next_arg(argc, argv, &i, "a client network");
+			weights = (struct weight_class*)realloc(weights,
+				(num_weights+1) * sizeof(*weights));
+			if (weights == NULL)
+				ERR("Can't allocate weight classes.");
+			if (sscanf(arg, "%31[0-9.]/%d", net, &bits) < 1 ||
+			    inet_addr(net) == INADDR_NONE ||
+			    bits < 0 || bits > 32)
+			{
+				printf("'%s' is a silly network.\n", arg);
+				return EXIT_FAILURE;
+			}
+			weights[num_weights].mask = bits ?
+				0xFFFFFFFFUL << (32 - bits) & 0xFFFFFFFFUL : 0;
+			weights[num_weights].net = ntohl(inet_addr(net)) &
+				weights[num_weights].mask;
 
-	free(conn_in);
-	free(conn_out);
-	free(backlog_in);
-	free(backlog_in_size);
-	free(backlog_in_pos);
-	free(backlog_out);
-	free(backlog_out_size);
-	free(backlog_out_pos);
+			arg = next_arg(argc, argv, &i, "a weight");
+			weights[num_weights].weight = atoi(arg);
+			if (weights[num_weights].weight < 1)
+			{
+				printf("'%s' is a silly weight.\n", arg);
+				return EXIT_FAILURE;
+			}
+			num_weights++;
+		}
+		else
+		{
+			printf("Unrecognised argument '%s'\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
 
 #ifdef _WIN32
-	WSACleanup();
+	init_winsock();
 #endif
 
-	exit(EXIT_SUCCESS);
-}
-
-
-
-static int valid_socket(const int i)
-{
-	if (conn_in[i] != INVALID_SOCKET && conn_out[i] != INVALID_SOCKET)
-		return 1;
-	else if (
-	(conn_in[i] == INVALID_SOCKET && conn_out[i] != INVALID_SOCKET) ||
-	(conn_in[i] != INVALID_SOCKET && conn_out[i] == INVALID_SOCKET)
-	)
-		ERR("internal inconsistency! in[%d]=%d, out[%d]=%d",
-			i, conn_in[i], i, conn_out[i]);
-
-	/* else both are INVALID */
-	return 0;
-}
-
+	if (verbose)
+		printf("Forwarding port %d to %s:%d.\n",
+			localport, remotehost, remoteport);
 
+	conn_in = (SOCKET*)malloc(max_connections * sizeof(SOCKET));
+	conn_out = (SOCKET*)malloc(max_connections * sizeof(SOCKET));
+	backlog_in = (char**)calloc(max_connections, sizeof(char*));
+	backlog_in_size = (int*)malloc(max_connections * sizeof(int));
+	backlog_in_pos = (int*)malloc(max_connections * sizeof(int));
+	backlog_out = (char**)calloc(max_connections, sizeof(char*));
+	backlog_out_size = (int*)malloc(max_connections * sizeof(int));
+	backlog_out_pos = (int*)malloc(max_connections * sizeof(int));
+	backlog_in_class = (unsigned char*)calloc(max_connections, 1);
+	backlog_out_class = (unsigned char*)calloc(max_connections, 1);
+	read_in_avg = (int*)calloc(max_connections, sizeof(int));
+	read_out_avg = (int*)calloc(max_connections, sizeof(int));
+	zc_in_pending = (int*)calloc(max_connections, sizeof(int));
+	zc_out_pending = (int*)calloc(max_connections, sizeof(int));
+	last_active = (unsigned long*)calloc(max_connections,
+		sizeof(unsigned long));
+	conn_budget = (int*)malloc(max_connections * sizeof(int));
+	conn_ready = (unsigned char*)calloc(max_connections, 1);
+	is_ready = (unsigned char*)calloc(max_connections, 1);
+	slot_list = (int*)malloc(max_connections * sizeof(int));
+	slot_pos = (int*)malloc(max_connections * sizeof(int));
+	ready_list = (int*)malloc(max_connections * sizeof(int));
+	ready_next = (int*)malloc(max_connections * sizeof(int));
+	sockmap_state = (unsigned char*)calloc(max_connections, 1);
+	queued = (SOCKET*)malloc(max_connections * sizeof(SOCKET));
+	queued_since = (unsigned long*)malloc(max_connections *
+		sizeof(unsigned long));
+	queued_route = (int*)malloc(max_connections * sizeof(int));
 
-static void poll_conn(void)
-{
-	int select_ret, i;
-	fd_set r1_fd, w1_fd, r2_fd, w2_fd;
-	struct timeval timeout;
-	SOCKET max_fd;
+	if (conn_in == NULL
+	 || conn_out == NULL
+	 || backlog_in == NULL
+	 || backlog_in_size == NULL
+	 || backlog_in_pos == NULL
+	 || backlog_out == NULL
+	 || backlog_out_size == NULL
+	 || backlog_out_pos == NULL
+	 || backlog_in_class == NULL
+	 || backlog_out_class == NULL
+	 || read_in_avg == NULL
+	 || read_out_avg == NULL
+	 || zc_in_pending == NULL
+	 || zc_out_pending == NULL
+	 || last_active == NULL
+	 || conn_budget == NULL
+	 || conn_ready == NULL
+	 || is_ready == NULL
+	 || slot_list == NULL
+	 || slot_pos == NULL
+	 || ready_list == NULL
+	 || ready_next == NULL
+	 || sockmap_state == NULL
+	 || queued == NULL
+	 || queued_since == NULL
+	 || queued_route == NULL
+	 )
+		ERR("Can't allocate enough memory to initialize.");
 
-	/* stage 1: check for read/write-ability of all fds */
-	FD_ZERO(&w1_fd);
-	FD_ZERO(&r1_fd);
-	max_fd = 0;
-	for (i=0; i<max_connections; i++)
-	if (valid_socket(i))
+	if (compress_codec != CODEC_NONE && tunnel != TUNNEL_CLIENT)
 	{
-		FD_SET(conn_in[i], &w1_fd);
-		FD_SET(conn_in[i], &r1_fd);
-		FD_SET(conn_out[i], &w1_fd);
-		FD_SET(conn_out[i], &r1_fd);
-
-		max_fd = max(max_fd, max(conn_in[i], conn_out[i]));
+		printf("Only the -tunnel side picks a codec, "
+			"ignoring -compress.\n");
+		compress_codec = CODEC_NONE;
 	}
-
-	if (max_fd)
+	if (reverse != REVERSE_NONE && tunnel != TUNNEL_NONE)
 	{
-		/* poll! */
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 0;
-		select_ret = select(max_fd+1, &r1_fd, &w1_fd, NULL, &timeout);
-#ifdef DEBUG
-		if (verbose)
-		{
-			printf("stage 1 poll returned %d\n", select_ret);
-			printf("selected in stage 1: ");
-			show_state(r1_fd, w1_fd);
-			printf("\n");
-		}
-#endif
-		if (select_ret == -1) ERR("select() error in stage 1");
+		printf("-pool and -reverse can't be used in a tunnel.\n");
+		return EXIT_FAILURE;
 	}
-
-	/* stage 2: blocking poll */
-	FD_ZERO(&w2_fd);
-	FD_ZERO(&r2_fd);
-	max_fd = 0;
-
-	/* stage 2: poll sockin if we can accept another connection */
-	if (active_connections < max_connections)
+	if (proxy_protocol && (tunnel != TUNNEL_NONE ||
+			       reverse == REVERSE_BACKEND))
 	{
-		FD_SET(sockin, &r2_fd);
-		max_fd = max(max_fd, sockin);
+		printf("Only a portfwd taking clients straight from them can "
+			"send the PROXY header, ignoring -proxyv2.\n");
+		proxy_protocol = 0;
 	}
-
-	for (i=0; i<max_connections; i++)
-	if (valid_socket(i))
+	if (num_routes && (tunnel != TUNNEL_NONE || reverse != REVERSE_NONE))
 	{
-		/* poll matching write socket for backlogged sockets */
-		if (backlog_in_size[i]) FD_SET(conn_in[i], &w2_fd);
-		if (backlog_out_size[i]) FD_SET(conn_out[i], &w2_fd);
-
-		/* poll matching read sockets for writeable sockets
-		 * without a backlog */
-		if (FD_ISSET(conn_in[i], &w1_fd) &&
-		    !backlog_in_size[i])
-			FD_SET(conn_out[i], &r2_fd);
-
-		if (FD_ISSET(conn_out[i], &w1_fd) &&
-		    !backlog_out_size[i])
-			FD_SET(conn_in[i], &r2_fd);
-
-		/* poll matching write sockets for readable sockets */
-		if (FD_ISSET(conn_in[i], &r1_fd))
-			FD_SET(conn_out[i], &w2_fd);
-
-		if (FD_ISSET(conn_out[i], &r1_fd))
-			FD_SET(conn_in[i], &w2_fd);
-
-		max_fd = max(max_fd, max(conn_in[i], conn_out[i]));
+		printf("-route can't be used with a tunnel or a pool.\n");
+		return EXIT_FAILURE;
 	}
-
-	/* poll! (indefinitely) */
-	select_ret = select(max_fd+1, &r2_fd, &w2_fd, NULL, NULL);
-	if (select_ret == 0)
-		ERR("select()'s infinite timeout just timed out.");
-	if (select_ret == -1) ERR("select() error in stage 2");
-
-#ifdef DEBUG
-	if (verbose)
+	if (use_stripes && (tunnel != TUNNEL_CLIENT || num_links < 2))
 	{
-		printf("stage 2 poll returned %d\n", select_ret);
-		printf("selected in stage 2: ");
-		show_state(r2_fd, w2_fd);
-		printf("\n");
+		printf("Striping needs -tunnel with more than one link, "
+			"ignoring -stripe.\n");
+		use_stripes = 0;
 	}
-#endif
 
-	/* handle incoming connection if there is one */
-	if (FD_ISSET(sockin, &r2_fd)) accept_incoming();
+	if (reverse != REVERSE_NONE)
+	{
+		/* the public side holds at most one per slot */
+		if (reverse == REVERSE_PUBLIC) pool_size = max_connections;
+		pool = (SOCKET*)malloc(pool_size * sizeof(SOCKET));
+		pool_ready = (unsigned char*)malloc(pool_size);
+		if (pool == NULL || pool_ready == NULL)
+			ERR("Can't allocate the pool.");
+	}
 
-	/* merge fd_sets */
-	for (i=0; i<=max_fd; i++)
+	if (num_routes)
 	{
-		if (FD_ISSET(i, &r1_fd)) FD_SET(i, &r2_fd);
-		if (FD_ISSET(i, &w1_fd)) FD_SET(i, &w2_fd);
+		sniffing = (SOCKET*)malloc(max_connections * sizeof(SOCKET));
+		sniff_since = (unsigned long*)malloc(max_connections *
+			sizeof(unsigned long));
+		sniff_flags = (unsigned char*)malloc(max_connections);
+		if (sniffing == NULL || sniff_since == NULL ||
+		    sniff_flags == NULL)
+			ERR("Can't allocate routing state.");
+		init_signatures();
 	}
 
-	for (i=0; i<max_connections; i++)
+	if (num_acl_sources && (acl = load_acl()) == NULL)
+		return EXIT_FAILURE;
+
+#ifdef HAVE_SPILL
+	if (spill_dir != NULL)
 	{
-		/* flush backlogs, if any */
-		if (conn_in[i] != INVALID_SOCKET &&
-			backlog_in_size[i] && FD_ISSET(conn_in[i], &w2_fd))
+		if (tunnel != TUNNEL_NONE)
 		{
-			FD_CLR(conn_in[i], &w2_fd);
-			flush_backlog(i, IN);
+			printf("Tunnel streams can't spill, ignoring -spill.\n");
+			spill_dir = NULL;
+			spill_mem = 0;
 		}
-		if (conn_out[i] != INVALID_SOCKET &&
-			backlog_out_size[i] && FD_ISSET(conn_out[i], &w2_fd))
+		else
 		{
-			FD_CLR(conn_out[i], &w2_fd);
-			flush_backlog(i, OUT);
-		}
+			if (!spill_mem) spill_mem = SPILL_MEM;
 
-		/* plain forwarding */
-		if (valid_socket(i) &&
-			FD_ISSET(conn_in[i], &r2_fd) &&
-			FD_ISSET(conn_out[i], &w2_fd) )
-			bounce(conn_in[i], conn_out[i], i, OUT);
+			/* the kernel would forward without us seeing a stall */
+			if (use_sockmap)
+				printf("Spilling needs the data in userspace, "
+					"ignoring -sockmap.\n");
+			use_sockmap = 0;
 
-		if (valid_socket(i) &&
-			FD_ISSET(conn_out[i], &r2_fd) &&
-			FD_ISSET(conn_in[i], &w2_fd) )
-			bounce(conn_out[i], conn_in[i], i, IN);
+			spill_in_fd = (int*)malloc(max_connections *
+				sizeof(int));
+			spill_out_fd = (int*)malloc(max_connections *
+				sizeof(int));
+			spill_in_end = (off_t*)calloc(max_connections,
+				sizeof(off_t));
+			spill_out_end = (off_t*)calloc(max_connections,
+				sizeof(off_t));
+			spill_in_pos = (off_t*)calloc(max_connections,
+				sizeof(off_t));
+			spill_out_pos = (off_t*)calloc(max_connections,
+				sizeof(off_t));
+			spill_flags = (unsigned char*)calloc(max_connections,
+				1);
+			spill_buf = (char*)malloc(BACKLOG_SIZE);
+			if (spill_in_fd == NULL || spill_out_fd == NULL ||
+			    spill_in_end == NULL || spill_out_end == NULL ||
+			    spill_in_pos == NULL || spill_out_pos == NULL ||
+			    spill_flags == NULL || spill_buf == NULL)
+				ERR("Can't allocate spill state.");
+			for (i=0; i<max_connections; i++)
+				spill_in_fd[i] = spill_out_fd[i] = -1;
+		}
 	}
-}
-
-
-
-int main(int argc, char **argv)
-{
-	struct sockaddr_in addrin;
-	int i, sockopt;
+#endif
 
-	/* usage */
-	if (argc < 3)
+	if ((quota || quota_rate) && usage_path == NULL)
 	{
-		printf(
-"TCP Port Forwarder\n(c) 2000-2003, Emil Mikulic.\n\n"
-"usage: %s <src port> <remote ip>:<port> [-max <x>] [-v]\n"
-"By default, the maximum number of connections is %d.\n"
-"Verbosity is enabled using -v.\n\n", argv[0], max_connections);
-		return EXIT_SUCCESS;
+		printf("Quotas are kept in a -usage file.\n");
+		return EXIT_FAILURE;
 	}
-
-	/* arg1: local port */
-	localport = atoi(argv[1]);
-	if (localport == 0)
+	if (quota_rate && !quota)
 	{
-		printf("'%s' is a silly local port to use.\n", argv[1]);
-		return EXIT_FAILURE;
+		printf("-quota-rate needs a -quota, ignoring it.\n");
+		quota_rate = 0;
 	}
-
-	/* arg2: target */
-	remotehost = argv[2];
-	for (i=0; i<(int)strlen(argv[2]); i++)
+	if (usage_path != NULL)
 	{
-		if (argv[2][i] == ':') {
-			argv[2][i] = 0;
-			i++;
-			remoteport = atoi(argv[2]+i);
-			break;
+		if (!open_usage()) return EXIT_FAILURE;
+		conn_client = (int*)malloc(max_connections * sizeof(int));
+		unfolded_in = (unsigned long*)calloc(max_connections,
+			sizeof(unsigned long));
+		unfolded_out = (unsigned long*)calloc(max_connections,
+			sizeof(unsigned long));
+		over_quota = (unsigned char*)calloc(max_connections, 1);
+		if (quota_rate)
+		{
+			usage_tokens = (long*)calloc(usage_hdr->entries,
+				sizeof(long));
+			usage_refilled = (unsigned long*)calloc(
+				usage_hdr->entries, sizeof(unsigned long));
+		}
+		if (conn_client == NULL || unfolded_in == NULL ||
+		    unfolded_out == NULL || over_quota == NULL ||
+		    (quota_rate && (usage_tokens == NULL ||
+				    usage_refilled == NULL)))
+			ERR("Can't allocate usage state.");
+		for (i=0; i<max_connections; i++)
+			conn_client[i] = -1;
+
+		/* quotas are checked as bytes go through us */
+		if (quota && use_sockmap)
+		{
+			printf("Quotas need the data in userspace, "
+				"ignoring -sockmap.\n");
+			use_sockmap = 0;
 		}
 	}
 
-	if (argv[2][i] == 0)
+	if (num_workers > 1 && (tunnel != TUNNEL_NONE ||
+	    reverse != REVERSE_NONE || usage_path != NULL))
 	{
-		printf("You didn't specify a remote port!\n");
-		return EXIT_FAILURE;
+		/* links, pools and the usage table aren't shared */
+		printf("Tunnels, pools and -usage need a single worker, "
+			"ignoring -workers.\n");
+		num_workers = 1;
 	}
-
-	if (remoteport == 0)
+	if (num_workers > 1 && srcport_lo &&
+	    srcport_hi - srcport_lo + 1 < num_workers)
 	{
-		printf("'%s' is a silly remote port to use.\n", argv[2]+i);
+		printf("%d workers can't share %d source ports.\n",
+			num_workers, srcport_hi - srcport_lo + 1);
 		return EXIT_FAILURE;
 	}
 
-	/* arg3: max */
-	if (argc > 3)
+	if (classify != CLASSIFY_NONE)
 	{
-		if (strcmp(argv[3],"-v") == 0)
+		/* the kernel wouldn't tell us what offloaded ones are up to */
+		if (classify == CLASSIFY_AUTO && use_sockmap)
 		{
-			verbose = 1;
+			printf("Telling traffic apart needs the data in "
+				"userspace, ignoring -sockmap.\n");
+			use_sockmap = 0;
 		}
-		else if (strcmp(argv[3],"-max") != 0)
+		traffic_class = (unsigned char*)calloc(max_connections, 1);
+		if (traffic_class == NULL)
+			ERR("Can't allocate traffic class state.");
+	}
+	if (classify == CLASSIFY_AUTO || num_workers > 1)
+	{
+		busy_ms = (unsigned short*)calloc(max_connections,
+			sizeof(unsigned short));
+		busy_tick = (unsigned long*)calloc(max_connections,
+			sizeof(unsigned long));
+		window_bytes = (unsigned long*)calloc(max_connections,
+			sizeof(unsigned long));
+		if (busy_ms == NULL || busy_tick == NULL ||
+		    window_bytes == NULL)
+			ERR("Can't allocate traffic window state.");
+	}
+
+	if (coalesce_min)
+	{
+		if (tunnel != TUNNEL_NONE)
 		{
-			printf("Unrecognised argument '%s'\n", argv[3]);
-			return EXIT_FAILURE;
+			/* links batch frames by themselves */
+			printf("Tunnel streams aren't coalesced, "
+				"ignoring -coalesce.\n");
+			coalesce_min = 0;
 		}
 		else
 		{
-			if (argc < 5)
-			{
-				printf("You didn't specify the maximum \
-number of connections.\n");
-				return EXIT_FAILURE;
-			}
-			max_connections = atoi(argv[4]);
-			if (max_connections < 1 || max_connections > 65535)
-			{
-				printf("'%s' is a silly maximum.\n", argv[4]);
-				return EXIT_FAILURE;
-			}
+			/* the kernel wouldn't hold anything back */
+			if (use_sockmap)
+				printf("Coalescing needs the data in userspace, "
+					"ignoring -sockmap.\n");
+			use_sockmap = 0;
 
-			if (argc > 5 && strcmp(argv[5],"-v") == 0)
-				verbose = 1;
+			corked_in = (int*)calloc(max_connections, sizeof(int));
+			corked_out = (int*)calloc(max_connections,
+				sizeof(int));
+			corked_in_since = (unsigned long*)calloc(
+				max_connections, sizeof(unsigned long));
+			corked_out_since = (unsigned long*)calloc(
+				max_connections, sizeof(unsigned long));
+			if (corked_in == NULL || corked_out == NULL ||
+			    corked_in_since == NULL || corked_out_since == NULL)
+				ERR("Can't allocate coalescing state.");
 		}
 	}
 
+	if (tunnel != TUNNEL_NONE)
+	{
+		/* these need a real socket on both sides */
+		if (zerocopy_min || use_sockmap)
+			printf("Tunnel streams can't use -zerocopy or "
+				"-sockmap, ignoring.\n");
+		zerocopy_min = use_sockmap = 0;
+
+		/* the server side looks streams up by (link, id) */
+		if (tunnel == TUNNEL_SERVER)
+			while ((1 << hash_bits) < 2 * max_connections)
+				hash_bits++;
+
+		links = (struct link*)calloc(num_links, sizeof(*links));
+		stream_link = (int*)calloc(max_connections, sizeof(int));
+		stream_id = (unsigned int*)calloc(max_connections,
+			sizeof(unsigned int));
+		stream_credit = (int*)calloc(max_connections, sizeof(int));
+		stream_owed = (int*)calloc(max_connections, sizeof(int));
+		stream_hash = (int*)calloc(1 << hash_bits, sizeof(int));
+		stream_codec = (unsigned char*)calloc(max_connections, 1);
+		stream_flags = (unsigned char*)calloc(max_connections, 1);
+		stream_tx_seq = (unsigned int*)calloc(max_connections,
+			sizeof(unsigned int));
+		stream_rx_seq = (unsigned int*)calloc(max_connections,
+			sizeof(unsigned int));
+		stream_end = (unsigned int*)calloc(max_connections,
+			sizeof(unsigned int));
+		stream_held = (int*)calloc(max_connections, sizeof(int));
+		held_frames = (struct held**)calloc(max_connections,
+			sizeof(struct held*));
+		pack_skip = (unsigned char*)calloc(max_connections, 1);
+		pack_misses = (unsigned char*)calloc(max_connections, 1);
+		if (links == NULL || stream_link == NULL ||
+		    stream_id == NULL || stream_credit == NULL ||
+		    stream_owed == NULL || stream_hash == NULL ||
+		    stream_codec == NULL || pack_skip == NULL ||
+		    pack_misses == NULL || stream_flags == NULL ||
+		    stream_tx_seq == NULL || stream_rx_seq == NULL ||
+		    stream_end == NULL || stream_held == NULL ||
+		    held_frames == NULL)
+			ERR("Can't allocate tunnel state.");
+
+		/* tells the server which links are ours */
+		if (tunnel == TUNNEL_CLIENT)
+		{
 #ifdef _WIN32
-	init_winsock();
+			peer_tag = (unsigned int)GetCurrentProcessId();
+#else
+			peer_tag = (unsigned int)getpid();
 #endif
+			peer_tag = (peer_tag << 16) ^
+				(unsigned int)get_time_ms();
+		}
 
-	if (verbose)
-		printf("Forwarding port %d to %s:%d.\n",
-			localport, remotehost, remoteport);
+		/* the server side packs with whatever the client asks for */
+		if (compress_codec != CODEC_NONE ||
+		    (tunnel == TUNNEL_SERVER && codecs_built()))
+		{
+			pack_buf = (char*)malloc(BACKLOG_SIZE);
+			if (pack_buf == NULL)
+				ERR("Can't allocate compression buffer.");
+		}
+#ifdef HAVE_ZSTD
+		zstd_c = ZSTD_createCCtx();
+		zstd_d = ZSTD_createDCtx();
+		if (zstd_c == NULL || zstd_d == NULL)
+			ERR("Can't set up zstd.");
+#endif
+		for (i=0; i<num_links; i++)
+			links[i].s = INVALID_SOCKET;
+	}
 
-	conn_in = (SOCKET*)malloc(max_connections * sizeof(SOCKET));
-	conn_out = (SOCKET*)malloc(max_connections * sizeof(SOCKET));
-	backlog_in = (char**)malloc(max_connections * sizeof(char*));
-	backlog_in_size = (int*)malloc(max_connections * sizeof(int));
-	backlog_in_pos = (int*)malloc(max_connections * sizeof(int));
-	backlog_out = (char**)malloc(max_connections * sizeof(char*));
-	backlog_out_size = (int*)malloc(max_connections * sizeof(int));
-	backlog_out_pos = (int*)malloc(max_connections * sizeof(int));
+#ifdef HAVE_WORKERS
+	/* from here on, everything is each worker's own */
+	if (num_workers > 1) start_workers();
+#endif
 
-	if (conn_in == NULL
-	 || conn_out == NULL
-	 || backlog_in == NULL
-	 || backlog_in_size == NULL
-	 || backlog_in_pos == NULL
-	 || backlog_out == NULL
-	 || backlog_out_size == NULL
-	 || backlog_out_pos == NULL
-	 )
-		ERR("Can't allocate enough memory to initialize.");
+#ifdef HAVE_SOCKMAP
+	if (use_sockmap && !init_sockmap())
+	{
+		printf("Forwarding in userspace only.\n");
+		use_sockmap = 0;
+	}
+#endif
+
+	/* zerocopy needs buffers whose pages can be handed to the kernel */
+	page_buffers = (zerocopy_min != 0);
+#ifndef _WIN32
+	init_arena();
+#endif
 
+	/* buffers are attached when there's data to move */
 	for (i=0; i<max_connections; i++)
 	{
 		conn_in[i] = conn_out[i] = INVALID_SOCKET;
-		backlog_in[i] = (char*)malloc(BACKLOG_SIZE);
-		backlog_out[i] = (char*)malloc(BACKLOG_SIZE);
 		backlog_in_size[i] = backlog_out_size[i] =
 			backlog_in_pos[i] = backlog_out_pos[i] = 0;
-
-		if (!backlog_in[i] || !backlog_out[i])
-			ERR("Can't allocate enough memory for backlogs.\n\
-Try decreasing the number of maximum connections.");
 	}
 
 	(void) signal(SIGTERM, term_signal);
 	(void) signal(SIGINT, term_signal);
 #ifndef _WIN32
 	(void) signal(SIGPIPE, broken_pipe);
+	(void) signal(SIGUSR1, stats_signal);
+	(void) signal(SIGHUP, reload_signal);
 #endif
 
-	/* create the incoming socket */
-	sockin = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockin < 0) ERR("problem creating incoming socket");
+	sockin = open_listener(localport);
+#ifdef HAVE_ACL_FILTER
+	if (acl != NULL) filter_acl();
+#endif
 
-	/* fill out a sockaddr struct */
-	addrin.sin_family = AF_INET;
-	addrin.sin_port = htons(localport);
-	addrin.sin_addr.s_addr = INADDR_ANY;
-	memset(&(addrin.sin_zero), 0, 8);
+#ifdef TCP_FASTOPEN
+	if (fastopen_qlen &&
+	    setsockopt(sockin, IPPROTO_TCP, TCP_FASTOPEN,
+			(char*)&fastopen_qlen, sizeof(fastopen_qlen)) < 0)
+		ERR("can't enable TCP_FASTOPEN");
+#endif
+#ifdef TCP_DEFER_ACCEPT
+	if (defer_accept &&
+	    setsockopt(sockin, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+			(char*)&defer_accept, sizeof(defer_accept)) < 0)
+		ERR("can't enable TCP_DEFER_ACCEPT");
+#endif
 
-	/* reuse address */
-	sockopt = 1;
-	if (setsockopt(sockin, SOL_SOCKET, SO_REUSEADDR, (char*)&sockopt,
-				sizeof(sockopt)) < 0)
-		ERR("can't REUSEADDR");
+#ifdef USE_EPOLL
+	epfd = epoll_create(max_connections * 2 + 1);
+	if (epfd < 0) ERR("can't create epoll instance");
+	{
+		struct epoll_event ev;
 
-	/* bind sockin to the incoming port */
-	if (bind(sockin, (struct sockaddr *)&addrin,
-		sizeof(struct sockaddr)) < 0)
+		ev.events = EPOLLIN;
+		ev.data.u32 = SOCKIN_ID;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockin, &ev) < 0)
+			ERR("can't watch incoming socket");
+		sockin_watched = 1;
+	}
+#ifdef HAVE_WORKERS
+	if (handoff_in != INVALID_SOCKET)
 	{
-#ifndef _WIN32
-		if (getuid() != 0 && localport < 1024)
-			ERR("problem binding incoming socket\n\
-You need to be root to bind to a port under 1024.");
-		else
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN;
+		ev.data.u32 = HANDOFF_ID;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, handoff_in, &ev) < 0)
+			ERR("can't watch handoff socket");
+	}
+#endif
+#endif
+
+	if (reverse == REVERSE_PUBLIC)
+	{
+		poolin = open_listener(pool_port);
+#ifdef USE_EPOLL
+		{
+			struct epoll_event ev;
+
+			ev.events = EPOLLIN;
+			ev.data.u32 = POOLIN_ID;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, poolin, &ev) < 0)
+				ERR("can't watch pool socket");
+			poolin_watched = 1;
+		}
 #endif
-			ERR("problem binding incoming socket\n\
-Maybe it's already in use?");
 	}
 
-	/* listen on the socket */
-	if (listen(sockin, max_connections) < 0)
-		ERR("problem listen()ing to incoming socket");
+#ifndef _WIN32
+	/* kept in reserve for turning clients away when out of fds */
+	spare_fd = open("/dev/null", O_RDONLY);
+#endif
+
+	/* warm up the links and the pool before any client needs them */
+	now = get_time_ms();
+	for (i=0; i<num_links && tunnel == TUNNEL_CLIENT; i++)
+		open_link(i);
+	if (reverse == REVERSE_BACKEND) fill_pool();
 
 	if (verbose) printf("Waiting for connections...\n");
 